@@ -5,19 +5,25 @@
 #include <cassert>
 #include <charconv>
 #include <chrono>
+#include <climits>
 #include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <functional>
+#include <limits>
 #include <list>
+#include <map>
 #include <mutex>
 #include <optional>
 #include <random>
 #include <string>
 #include <thread>
 #include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <fstream>
 #include <array>
 #include <cstdint>
@@ -25,7 +31,26 @@
 
 #include <unistd.h>
 #include <signal.h> // for raise
+#include <dirent.h> // for DT_* of getdents64 entries
 #include <dlfcn.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <spawn.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define BPP_HAVE_IO_URING 1
+#endif
 
 #ifndef BPP_RECOMPILE_SELF_CMD
 #error R"(To use this library you need to setup how this script will be compiled This is done through this macro (where error is emited). Try to define it just before including header as follows: clang++ -O0)"
@@ -33,24 +58,7 @@
 
 struct Build;
 void configure(Build* b); // expected signature of build function
-
-static std::mutex print_mutex;
-inline int log(const char* fmt, ...) {
-    std::lock_guard<std::mutex> lock(print_mutex);
-    va_list args;
-    va_start(args, fmt);
-    auto res = vprintf(fmt, args);
-    va_end(args);
-    fflush(stdout);
-    return res;
-}
-
-inline int vlog(const char* fmt, va_list args) {
-    std::lock_guard<std::mutex> lock(print_mutex);
-    auto res = vprintf(fmt, args);
-    fflush(stdout);
-    return res;
-}
+using ConfigureFn = void (*)(Build*);
 
 struct Hash {
     uint64_t value = 0;
@@ -69,11 +77,128 @@ struct Hash {
     }
 };
 
-struct Option {
-    std::string key;
-    std::string description = "";
+// file content hash, remembers what file looked like when it was hashed
+struct FileHashEntry {
+    Hash hash;
+    int64_t mtime_ns = 0;
+    uint64_t size = 0;
+};
+
+// file hashes by path. split into shards with their own locks, so threads hashing or looking up different files
+// rarely wait for each other
+struct FileHashCache {
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<std::filesystem::path, FileHashEntry> entries;
+    };
+    std::array<Shard, 64> shards;
+
+    Shard& shardOf(const std::filesystem::path& path) {
+        return shards[std::filesystem::hash_value(path) % shards.size()];
+    }
+
+    std::optional<Hash> find(const std::filesystem::path& path) {
+        auto& shard = shardOf(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(path);
+        if (it == shard.entries.end()) return std::nullopt;
+        return it->second.hash;
+    }
+
+    bool contains(const std::filesystem::path& path) {
+        return find(path).has_value();
+    }
+
+    void put(const std::filesystem::path& path, FileHashEntry entry) {
+        auto& shard = shardOf(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries[path] = entry;
+    }
+
+    void erase(const std::filesystem::path& path) {
+        auto& shard = shardOf(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.entries.erase(path);
+    }
+
+    // shards are locked one by one, so entries put meanwhile may be missed
+    template <typename F>
+    void forEach(F fn) {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (const auto& [path, entry] : shard.entries) fn(path, entry);
+        }
+    }
+
+    template <typename F>
+    void eraseIf(F pred) {
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.entries.begin(); it != shard.entries.end();) {
+                it = pred(it->first, it->second) ? shard.entries.erase(it) : std::next(it);
+            }
+        }
+    }
+
+    size_t size() {
+        size_t res = 0;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            res += shard.entries.size();
+        }
+        return res;
+    }
+};
+
+// resources consumed by child processes
+struct ProcessUsage {
+    uint64_t user_us = 0;
+    uint64_t sys_us = 0;
+    uint64_t peak_rss_kb = 0;
+    uint64_t read_bytes = 0; // by read-like syscalls, including ones served from page cache
+    uint64_t write_bytes = 0;
+    int exit_code = 0; // of last failed command
+
+    void add(const ProcessUsage& other) {
+        if (other.exit_code != 0) exit_code = other.exit_code;
+        user_us += other.user_us;
+        sys_us += other.sys_us;
+        peak_rss_kb = std::max(peak_rss_kb, other.peak_rss_kb);
+        read_bytes += other.read_bytes;
+        write_bytes += other.write_bytes;
+    }
 };
 
+// one component of step key, for telling why step was rebuilt (--explain)
+struct KeyItem {
+    std::string kind;
+    std::string what;
+    uint64_t hash = 0;
+};
+
+// process-wide state. build scripts loaded as plugins (see Build::loadBuildScript) are attached to the state of the tool binary
+// via bpp_attach_runtime, so caches and output locking are shared instead of duplicated per loaded module
+struct Runtime {
+    std::mutex print_mutex;
+    FileHashCache hash_cache;
+    std::mutex depfile_mutex;
+    std::unordered_map<std::filesystem::path, std::vector<std::filesystem::path>> depfile_cache; // depfiles are immutable cache entries
+    std::mutex usage_mutex;
+    std::unordered_map<std::thread::id, ProcessUsage> thread_usage; // threads performing step actions, see runCmd
+    std::string progress_line; // guarded by print_mutex
+    std::atomic<bool> capture_output = false; // commands must not write to terminal directly, it would break progress line
+    std::mutex explain_mutex;
+    std::unordered_map<std::thread::id, std::vector<KeyItem>> explain_items; // threads computing step keys, see explainKeyItem
+    std::atomic<bool> io_uring = false; // --io-uring, see hashFiles
+};
+
+static Runtime bpp_runtime_storage;
+static Runtime* bpp_runtime = &bpp_runtime_storage;
+
+inline Runtime* runtime() {
+    return bpp_runtime;
+}
+
 struct Colorizer {
     bool enabled;
     FILE* out;
@@ -103,6 +228,42 @@ struct Colorizer {
     }
 };
 
+inline int vlog(const char* fmt, va_list args) {
+    auto* rt = runtime();
+    std::lock_guard<std::mutex> lock(rt->print_mutex);
+    // progress line stays the last one, messages go above it
+    Colorizer c{stdout};
+    if (!rt->progress_line.empty()) printf("%s", c.discard_prev_line());
+    auto res = vprintf(fmt, args);
+    if (!rt->progress_line.empty()) printf("%s\n", rt->progress_line.c_str());
+    fflush(stdout);
+    return res;
+}
+
+inline int log(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    auto res = vlog(fmt, args);
+    va_end(args);
+    return res;
+}
+
+// replaces status line shown at the bottom of terminal, empty line removes it
+inline void showProgressLine(const std::string& line) {
+    auto* rt = runtime();
+    std::lock_guard<std::mutex> lock(rt->print_mutex);
+    Colorizer c{stdout};
+    if (!rt->progress_line.empty()) printf("%s", c.discard_prev_line());
+    rt->progress_line = line;
+    if (!line.empty()) printf("%s\n", line.c_str());
+    fflush(stdout);
+}
+
+struct Option {
+    std::string key;
+    std::string description = "";
+};
+
 [[noreturn]] inline void exitFailedOrTrap(int code) {
 #ifdef BPP_DEBUG_MODE
     raise(SIGTRAP);
@@ -129,6 +290,144 @@ inline std::string escapeStringJSON(std::string_view arg) {
     return escaped;
 }
 
+// minimal json reader for outputs of tools (P1689 module dependency files and alike)
+struct JsonValue {
+    enum class Type { Null, Bool, Number, String, Array, Object } type = Type::Null;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object; // in order of appearance
+
+    const JsonValue* get(std::string_view key) const {
+        for (const auto& [k, v] : object) {
+            if (k == key) return &v;
+        }
+        return nullptr;
+    }
+};
+
+struct JsonReader {
+    std::string_view text;
+    size_t pos = 0;
+    int depth = 0;
+
+    void skipSpaces() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r')) pos++;
+    }
+
+    bool consume(std::string_view token) {
+        if (text.substr(pos, token.size()) != token) return false;
+        pos += token.size();
+        return true;
+    }
+
+    bool readString(std::string* out) {
+        if (!consume("\"")) return false;
+        while (pos < text.size() && text[pos] != '"') {
+            char c = text[pos++];
+            if (c != '\\') {
+                *out += c;
+                continue;
+            }
+            if (pos >= text.size()) return false;
+            c = text[pos++];
+            switch (c) {
+                case 'b': *out += '\b'; break;
+                case 'f': *out += '\f'; break;
+                case 'n': *out += '\n'; break;
+                case 'r': *out += '\r'; break;
+                case 't': *out += '\t'; break;
+                case 'u': {
+                    if (pos + 4 > text.size()) return false;
+                    unsigned code = 0;
+                    auto res = std::from_chars(text.data() + pos, text.data() + pos + 4, code, 16);
+                    if (res.ptr != text.data() + pos + 4) return false;
+                    pos += 4;
+                    if (code < 0x80) { // surrogate pairs are not joined, tools do not emit them for paths and names
+                        *out += static_cast<char>(code);
+                    } else if (code < 0x800) {
+                        *out += static_cast<char>(0xC0 | (code >> 6));
+                        *out += static_cast<char>(0x80 | (code & 0x3F));
+                    } else {
+                        *out += static_cast<char>(0xE0 | (code >> 12));
+                        *out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                        *out += static_cast<char>(0x80 | (code & 0x3F));
+                    }
+                    break;
+                }
+                default: *out += c; // quote, backslash and slash
+            }
+        }
+        return consume("\"");
+    }
+
+    bool read(JsonValue* out) {
+        if (++depth > 256) return false;
+        skipSpaces();
+        bool ok = readValue(out);
+        skipSpaces();
+        depth--;
+        return ok;
+    }
+
+    bool readValue(JsonValue* out) {
+        if (pos >= text.size()) return false;
+        char c = text[pos];
+        if (c == '{') {
+            out->type = JsonValue::Type::Object;
+            pos++;
+            skipSpaces();
+            if (consume("}")) return true;
+            do {
+                skipSpaces();
+                std::string key;
+                if (!readString(&key)) return false;
+                skipSpaces();
+                if (!consume(":")) return false;
+                out->object.push_back({std::move(key), {}});
+                if (!read(&out->object.back().second)) return false;
+            } while (consume(","));
+            return consume("}");
+        }
+        if (c == '[') {
+            out->type = JsonValue::Type::Array;
+            pos++;
+            skipSpaces();
+            if (consume("]")) return true;
+            do {
+                out->array.emplace_back();
+                if (!read(&out->array.back())) return false;
+            } while (consume(","));
+            return consume("]");
+        }
+        if (c == '"') {
+            out->type = JsonValue::Type::String;
+            return readString(&out->string);
+        }
+        if (consume("true") || consume("false")) {
+            out->type = JsonValue::Type::Bool;
+            out->boolean = text[pos - 1] == 'e' && text[pos - 2] == 'u'; // "true"
+            return true;
+        }
+        if (consume("null")) return true;
+        // from_chars for double is not available in older standard libraries
+        size_t end = pos;
+        while (end < text.size() && std::strchr("+-.0123456789eE", text[end])) end++;
+        if (end == pos) return false;
+        out->type = JsonValue::Type::Number;
+        out->number = std::strtod(std::string{text.substr(pos, end - pos)}.c_str(), nullptr);
+        pos = end;
+        return true;
+    }
+};
+
+// false if text is not a single valid json value
+inline bool parseJson(std::string_view text, JsonValue* out) {
+    JsonReader reader{text};
+    return reader.read(out) && reader.pos == text.size();
+}
+
 inline std::string escapeStringBash(std::string_view arg) {
     std::string escaped;
     for (char c : arg) {
@@ -160,6 +459,10 @@ struct Step {
         std::string desc;
         bool phony{false};
         bool silent{false};
+        std::string pool; // see Build::addPool, empty means only job slot is needed
+        // named files (or dirs) the action creates inside of its output dir. each is referenced by output(name) and
+        // hashed by its content for dependants, so they rebuild only when the output they use changes
+        std::vector<Path> outputs = {};
     } opts;
 
     // Plain dependencies - other steps that must be completed before this one.
@@ -169,9 +472,14 @@ struct Step {
 
     std::function<Hash(Hash)> inputs_hash = [](Hash h) { return h; }; // what this step depends other than other steps
     std::function<void(Output)> action = [](Output) {};
+    // called once step is completed (performed or found in cache) with its artifact. may add steps and dependencies to
+    // the running build (dynamic dependencies, like generated sources known only after generation), see runScheduler
+    std::function<void(Path)> dyndep = nullptr;
 
     // NOTE: Step is considered up-to-date if its hash + combined hash of dependencies does not exist in cache
     std::optional<Hash> hash;
+    // opts.name made unique within build, keys what is remembered about step across runs. see Build::assignUniqueName
+    std::string unique_name;
 
     // this thread-safety stuff is needed to allow parallel builds not stupidly wait for 16ms on each step
     bool completed = false;
@@ -197,6 +505,15 @@ struct Step {
     void dependOn(Step* other) {
         deps.push_back(other);
     }
+
+    bool declaresOutput(const Path& name) const {
+        return std::find(opts.outputs.begin(), opts.outputs.end(), name) != opts.outputs.end();
+    }
+
+    LazyPath output(const Path& name) {
+        if (!declaresOutput(name)) panic("Step \"%s\" does not declare output \"%s\"\n", opts.name.c_str(), name.c_str());
+        return LazyPath{.step = this, .path = name};
+    }
 };
 
 struct Define {
@@ -222,6 +539,13 @@ enum class CXXStandard {
     CXX23,
 };
 
+// how C/C++ sources and headers are hashed into keys of objs
+enum class SourceHashing {
+    Bytes,
+    Tokens, // comment and whitespace edits do not recompile, unless they move tokens to other lines
+    TokensIgnoringLines, // same, but moved lines do not recompile too. __LINE__, assert() and debug info may get stale
+};
+
 // leaving nullopt will make it be taken from global flags
 struct CXXFlagsOverlay {
     std::optional<Path> compile_driver;
@@ -289,11 +613,69 @@ struct ObjOpts {
     // but for manual obj creation it may be useful
     // must point to stable location inside of created Lib or Exe structure
     LibOrExeCXXFlagsOverlay* opt_whole = nullptr;
+
+    // precompiled header step to force-include, filled on addLib/addExe calls with PchOpts given
+    std::optional<LazyPath> pch = std::nullopt;
+
+    bool modules = false; // source may declare or import named modules, see Build::resolveModules
+
+    // source produced by other step, usually its declared output (see Step::output), used instead of source.
+    // obj is ordered after that step and rebuilt only when this output changes
+    std::optional<LazyPath> generated_source = std::nullopt;
 };
 
 struct Obj {
     ObjOpts opts;
     Step* step;
+    std::vector<Path> unity_sources = {}; // sources included by generated unity source, for compile_commands.json
+};
+
+// precompiled header of exe or lib. it is built with the same flags as objs of target before them, and each obj is
+// compiled with it force-included. automatic mode takes <...> includes found at top level of at least half of sources,
+// that resolve outside of project root by dependency scans of sources, so project headers that change often are not
+// precompiled
+struct PchOpts {
+    Path header = {};
+    bool automatic = false;
+    size_t max_headers = 16;
+};
+
+struct Pch {
+    std::string target;
+    PchOpts opts;
+    ObjOpts obj; // flags of objs of target
+    std::vector<Path> sources;
+    Step* step;
+};
+
+// what compiler behind compile driver is, detected once by running it
+struct CompilerInfo {
+    bool clang = false;
+    int major = 0;
+    bool has_scan_deps = false; // clang-scan-deps is available for P1689 module scanning
+    // headers found there are not hashed one by one, identity (binary, version, mtimes of these dirs) stands for all of them
+    std::vector<Path> system_include_dirs;
+    Hash identity{};
+};
+
+// named modules translation unit declares and imports, as P1689 logical names ("foo", "foo:part")
+struct ModuleUnit {
+    std::vector<std::string> provides;
+    std::vector<std::string> imports;
+
+    bool operator==(const ModuleUnit& other) const { return provides == other.provides && imports == other.imports; }
+};
+
+// unity (jumbo) build of exe or lib: sources are merged into generated batch sources, that are compiled as few large objs.
+// batches are balanced by compile time from step history, or by source size when it is not known for every source.
+// edited source leaves its batch and is compiled alone until it stays unchanged for working_set_runs configures, so
+// editing it does not recompile the whole batch again and again. sources must not clash in anonymous namespaces and
+// statics. state is decided while configuring, so such targets are not snapshotted and build server keeps batches
+// as they were at its start
+struct UnityOpts {
+    bool enabled = false;
+    size_t batch_size = 8; // average count of sources per batch
+    uint64_t working_set_runs = 10;
 };
 
 struct ExeOpts {
@@ -302,6 +684,10 @@ struct ExeOpts {
     CXXFlagsOverlay obj = {};
     CXXFlagsOverlay link = {};
     LibOrExeCXXFlagsOverlay exe_flags = {};
+    PchOpts pch = {};
+    bool modules = false; // not part of graph snapshot, targets with modules are not snapshotted
+    UnityOpts unity = {}; // not part of graph snapshot, unity targets are not snapshotted
+    std::vector<LazyPath> generated_sources = {}; // outputs of other steps compiled as separate objs, see ObjOpts
 };
 
 struct Exe {
@@ -315,6 +701,13 @@ struct Exe {
             if (in.step) in.step->deps.push_back(other);
         }
     }
+
+    // objs of executable use declared output of other step (generated header), so they are rebuilt only when it changes
+    void dependExeOn(LazyPath output) {
+        for (auto in : link_step->inputs) {
+            if (in.step) in.step->inputs.push_back(output);
+        }
+    }
 };
 
 struct LibraryOpts {
@@ -323,6 +716,10 @@ struct LibraryOpts {
     CXXFlagsOverlay obj = {};
     bool static_lib = true;
     LibOrExeCXXFlagsOverlay lib_flags = {};
+    PchOpts pch = {};
+    bool modules = false; // not part of graph snapshot, targets with modules are not snapshotted
+    UnityOpts unity = {}; // not part of graph snapshot, unity targets are not snapshotted
+    std::vector<LazyPath> generated_sources = {}; // outputs of other steps compiled as separate objs, see ObjOpts
 };
 
 struct Lib {
@@ -337,6 +734,13 @@ struct Lib {
         }
     }
 
+    // objs of lib use declared output of other step (generated header), so they are rebuilt only when it changes
+    void dependLibOn(LazyPath output) {
+        for (auto in : link_step->inputs) {
+            if (in.step) in.step->inputs.push_back(output);
+        }
+    }
+
     std::string libName() const {
         if (opts.static_lib) {
             return "lib" + opts.name + ".a";
@@ -354,6 +758,24 @@ struct RunOptions {
     std::vector<std::string> args = {}; // arguments to pass to the executable
 };
 
+// tool that takes many inputs per invocation (protoc, flatc, moc). cmd runs once per chunk of inputs that are not
+// cached yet: {in} is replaced by inputs of chunk, {out} by directory the tool writes outputs into. outputs are names
+// of files made for every input inside of {out}, "{stem}" and "{name}" are replaced by stem and file name of input
+struct BatchCommandOpts {
+    std::string name;
+    std::string desc = "";
+    std::string cmd;
+    std::vector<LazyPath> inputs = {}; // must name files, plain paths are relative to root
+    std::vector<std::string> outputs = {}; // e.g. {"{stem}.pb.h", "{stem}.pb.cc"}
+    size_t chunk_size = 64;
+};
+
+struct BatchCommand {
+    BatchCommandOpts opts;
+    Step* step;
+    std::vector<Hash> keys = {}; // cache entry with outputs of every input, same order as opts.inputs
+};
+
 struct SubProjOpts {
     std::string name;
     Dir dir;
@@ -388,32 +810,143 @@ inline Hash hashString(std::string_view str) {
     return hash;
 }
 
+// continues hash of file content with next bytes, size must be multiple of 8 unless these are the last bytes of file
+inline Hash hashBytes(Hash hash, const char* data, size_t size) {
+    // first hash as uint64_t
+    for (size_t i = 0; i < size / sizeof(uint64_t); ++i) {
+        uint64_t batch = 0;
+        std::memcpy(&batch, data + i * sizeof(uint64_t), sizeof(batch));
+        hash = hash.combine(Hash{batch});
+    }
+    // handle remaining bytes
+    for (size_t i = (size / sizeof(uint64_t)) * sizeof(uint64_t); i < size; ++i) {
+        hash = hash.combine(Hash{static_cast<uint64_t>(data[i])});
+    }
+    return hash;
+}
+
+// C/C++ source reduced to its tokens: comments and whitespace between tokens are dropped, space is kept only where
+// removing it would glue two tokens together. newlines are kept since preprocessor directives end on them, and with
+// keep_lines their count is kept too, so every token stays on its line for __LINE__ and debug info. space after name of
+// defined macro is kept as well, "#define F (x)" is not function-like.
+// whitespace inside of #x stringification and header names is lost, edits of it are not seen
+inline std::string normalizeSourceTokens(std::string_view src, bool keep_lines) {
+    auto is_ident = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$' || static_cast<unsigned char>(c) >= 0x80; };
+    // pairs that start a longer punctuator or a comment
+    auto glues = [](char a, char b) {
+        static constexpr std::string_view pairs[] = {
+            "++", "--", "<<", ">>", "->", "&&", "||", "==", "!=", "<=", ">=", "+=", "-=", "*=", "/=", "%=", "&=",
+            "|=", "^=", "::", "##", "..", ".*", "<:", ":>", "<%", "%>", "%:", "//", "/*",
+        };
+        for (auto p : pairs) if (p[0] == a && p[1] == b) return true;
+        return false;
+    };
+    std::string out;
+    out.reserve(src.size());
+    size_t newlines = 0;
+    bool space = false;
+    enum { None, Sharp, Define, Name } directive = None; // tokens seen of "#define NAME" on current line
+    auto emit = [&](std::string_view token) {
+        bool line_start = newlines > 0 || out.empty() || out.back() == '\n';
+        if (newlines > 0) {
+            out.append(keep_lines ? newlines : 1, '\n');
+        } else if (space && !out.empty() && out.back() != '\n') {
+            char a = out.back(), b = token[0];
+            bool quote_a = a == '"' || a == '\'', quote_b = b == '"' || b == '\'';
+            if ((is_ident(a) || quote_a) && (is_ident(b) || quote_b)) out += ' '; // u8 "x" is not u8"x"
+            else if (glues(a, b) || directive == Name) out += ' ';
+        }
+        if (line_start) directive = token == "#" ? Sharp : None;
+        else if (directive == Sharp) directive = token == "define" ? Define : None;
+        else directive = directive == Define ? Name : None;
+        newlines = 0;
+        space = false;
+        out += token;
+    };
+
+    size_t i = 0, n = src.size();
+    while (i < n) {
+        char c = src[i];
+        if (c == '\n') {
+            newlines++;
+            i++;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            space = true;
+            i++;
+        } else if (c == '\\' && i + 1 < n && (src[i + 1] == '\n' || (src[i + 1] == '\r' && i + 2 < n && src[i + 2] == '\n'))) {
+            // line continuation is a token of its own, otherwise macro body would look like end of directive
+            emit("\\");
+            i += src[i + 1] == '\n' ? 1 : 2;
+        } else if (c == '/' && i + 1 < n && src[i + 1] == '/') {
+            while (i < n && src[i] != '\n') {
+                if (src[i] == '\\' && i + 1 < n && src[i + 1] == '\n') newlines++, i++; // comment continues on next line
+                i++;
+            }
+            space = true;
+        } else if (c == '/' && i + 1 < n && src[i + 1] == '*') {
+            auto end = src.find("*/", i + 2);
+            end = end == std::string_view::npos ? n : end + 2;
+            newlines += std::count(src.begin() + i, src.begin() + end, '\n');
+            space = true;
+            i = end;
+        } else if (is_ident(c)) {
+            size_t start = i;
+            bool number = std::isdigit(static_cast<unsigned char>(c));
+            while (i < n) {
+                char d = src[i];
+                if (is_ident(d) || (number && d == '.')) {
+                    i++;
+                } else if (number && d == '\'' && i + 1 < n && is_ident(src[i + 1])) {
+                    i += 2; // digit separator
+                } else if (number && (d == '+' || d == '-') && (src[i - 1] == 'e' || src[i - 1] == 'E' || src[i - 1] == 'p' || src[i - 1] == 'P')) {
+                    i++;
+                } else {
+                    break;
+                }
+            }
+            auto word = src.substr(start, i - start);
+            bool raw = word == "R" || word == "u8R" || word == "uR" || word == "UR" || word == "LR";
+            if (raw && i < n && src[i] == '"') {
+                // raw string runs until )delim", whatever it contains
+                auto open = src.find('(', i);
+                if (open == std::string_view::npos) open = n;
+                auto close = std::string{")"} + std::string{src.substr(i + 1, open - i - 1)} + "\"";
+                auto end = src.find(close, open);
+                end = end == std::string_view::npos ? n : end + close.size();
+                emit(src.substr(start, end - start));
+                i = end;
+            } else {
+                emit(word);
+            }
+        } else if (c == '"' || c == '\'') {
+            size_t start = i++;
+            while (i < n && src[i] != c && src[i] != '\n') i += src[i] == '\\' && i + 1 < n ? 2 : 1;
+            if (i < n && src[i] == c) i++;
+            emit(src.substr(start, i - start));
+        } else {
+            emit(src.substr(i, 1));
+            i++;
+        }
+    }
+    return out; // trailing newlines do not move any token
+}
+
 // cached inside of one run. mark this function to be optimized even in debug mode
 inline Hash hashFile(Path path) {
-    static std::mutex hash_mutex;
-    static std::unordered_map<Path, Hash> hash_cache;
-    {
-        std::lock_guard<std::mutex> lock(hash_mutex);
-        if (hash_cache.count(path) > 0) return hash_cache[path];
-    }
+    auto* rt = runtime();
+    if (auto cached = rt->hash_cache.find(path)) return *cached;
 
     auto* fin = std::fopen(path.c_str(), "rb");
     if (!fin) panic("Failed to open file %s for hashing: %s\n", path.c_str(), strerror(errno));
+    struct stat st = {};
+    fstat(fileno(fin), &st);
 
     Hash hash{}; // bogus for empty files
     std::array<char, 32 * 1024> buffer;
     size_t buffer_size = 0;
 
     auto process_buf = [&]() {
-        // first hash as uint64_t
-        for (size_t i = 0; i < buffer_size / sizeof(uint64_t); ++i) {
-            auto batch = reinterpret_cast<uint64_t*>(buffer.data())[i];
-            hash = hash.combine(Hash{batch});
-        }
-        // handle remaining bytes
-        for (size_t i = (buffer_size / sizeof(uint64_t)) * sizeof(uint64_t); i < buffer_size; ++i) {
-            hash = hash.combine(Hash{static_cast<uint64_t>(buffer[i])});
-        }
+        hash = hashBytes(hash, buffer.data(), buffer_size);
         buffer_size = 0;
     };
 
@@ -427,23 +960,479 @@ inline Hash hashFile(Path path) {
     }
     std::fclose(fin);
 
-    std::lock_guard<std::mutex> lock(hash_mutex);
-    hash_cache[path] = hash;
+    rt->hash_cache.put(path, FileHashEntry{
+        .hash = hash,
+        .mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec,
+        .size = static_cast<uint64_t>(st.st_size),
+    });
     return hash;
 }
 
-inline Hash hashDirRec(Dir dir) {
-    Hash hash{};
-    std::vector<Path> entries;
-    for (auto entry : std::filesystem::recursive_directory_iterator{dir}) {
-        if (entry.is_regular_file()) {
-            entries.push_back(entry.path().lexically_relative(dir));
+// drops cached hashes of files that changed on disk since they were hashed. needed only by long-living processes
+inline void revalidateHashCache() {
+    runtime()->hash_cache.eraseIf([](const std::filesystem::path& path, const FileHashEntry& entry) {
+        struct stat st = {};
+        bool same = ::stat(path.c_str(), &st) == 0
+            && static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec == entry.mtime_ns
+            && static_cast<uint64_t>(st.st_size) == entry.size;
+        return !same;
+    });
+}
+
+// runs shell command like std::system does, and accounts resources it used to the step performed by calling thread.
+// output of non-interactive command is printed with log() once it exits, if that is required to keep progress line intact
+inline int runCmd(const std::string& cmd, bool interactive = false) {
+    const char* argv[] = {"sh", "-c", cmd.c_str(), nullptr};
+    auto* rt = runtime();
+    int out_pipe[2] = {-1, -1};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (interactive) {
+        showProgressLine(""); // it is redrawn when step completes
+    } else if (rt->capture_output && ::pipe2(out_pipe, O_CLOEXEC) == 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDERR_FILENO);
+    }
+    pid_t pid = 0;
+    int spawned = posix_spawn(&pid, "/bin/sh", &actions, nullptr, const_cast<char**>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    std::string output;
+    if (out_pipe[0] >= 0) {
+        ::close(out_pipe[1]);
+        char buf[4096];
+        while (spawned == 0) {
+            auto n = ::read(out_pipe[0], buf, sizeof(buf));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            output.append(buf, n);
+        }
+        ::close(out_pipe[0]);
+        if (!output.empty()) log("%s", output.c_str());
+    }
+    if (spawned != 0) return -1;
+
+    // while exited child is not reaped, its io counters (which include ones of its reaped children) are still readable
+    ProcessUsage used;
+    siginfo_t info = {};
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {}
+    std::ifstream io{"/proc/" + std::to_string(pid) + "/io"};
+    for (std::string key; io >> key;) {
+        uint64_t value = 0;
+        io >> value;
+        if (key == "rchar:") used.read_bytes = value;
+        if (key == "wchar:") used.write_bytes = value;
+    }
+
+    int status = 0;
+    rusage usage = {};
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    used.user_us = usage.ru_utime.tv_sec * 1000000ull + usage.ru_utime.tv_usec;
+    used.sys_us = usage.ru_stime.tv_sec * 1000000ull + usage.ru_stime.tv_usec;
+    used.peak_rss_kb = usage.ru_maxrss;
+    used.exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    std::lock_guard<std::mutex> lock(rt->usage_mutex);
+    auto it = rt->thread_usage.find(std::this_thread::get_id());
+    if (it != rt->thread_usage.end()) it->second.add(used);
+    return status;
+}
+
+// cgroup v2 directory of this process, empty if there is none
+inline Dir cgroupDir() {
+    std::ifstream fin{"/proc/self/cgroup"};
+    for (std::string line; std::getline(fin, line);) {
+        if (line.rfind("0::", 0) == 0) return Dir{"/sys/fs/cgroup"} / line.substr(4);
+    }
+    return {};
+}
+
+// calls fn with every cgroup from ours up to the root, limits of all of them apply to us
+inline void forEachCgroup(const std::function<void(const Dir&)>& fn) {
+    auto dir = cgroupDir();
+    if (dir.empty()) return;
+    while (true) {
+        fn(dir);
+        if (dir == "/sys/fs/cgroup" || dir == dir.parent_path()) break;
+        dir = dir.parent_path();
+    }
+}
+
+inline std::optional<uint64_t> readCgroupValue(const Path& path) {
+    std::ifstream fin{path};
+    std::string value;
+    if (!(fin >> value) || value == "max") return std::nullopt;
+    return std::strtoull(value.c_str(), nullptr, 10);
+}
+
+// number of cpus we may use: affinity mask and cgroup cpu.max quota
+inline int availableCpus() {
+    int cpus = static_cast<int>(std::thread::hardware_concurrency());
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) cpus = CPU_COUNT(&set);
+    forEachCgroup([&](const Dir& dir) {
+        std::ifstream fin{dir / "cpu.max"};
+        std::string quota;
+        uint64_t period = 0;
+        if (!(fin >> quota >> period) || quota == "max" || period == 0) return;
+        auto quota_cpus = (std::strtoull(quota.c_str(), nullptr, 10) + period - 1) / period;
+        cpus = std::min<int>(cpus, static_cast<int>(std::max<uint64_t>(quota_cpus, 1)));
+    });
+    return std::max(cpus, 1);
+}
+
+inline std::optional<uint64_t> cgroupMemoryLimit() {
+    std::optional<uint64_t> limit;
+    forEachCgroup([&](const Dir& dir) {
+        auto max = readCgroupValue(dir / "memory.max");
+        if (max && (!limit || *max < *limit)) limit = max;
+    });
+    return limit;
+}
+
+// bytes that may be allocated right now without swapping or hitting cgroup limit. page cache of files is reclaimed
+// by kernel when needed, so it is not counted as used
+inline uint64_t memoryHeadroom() {
+    uint64_t headroom = UINT64_MAX;
+    std::ifstream meminfo{"/proc/meminfo"};
+    for (std::string key; meminfo >> key;) {
+        uint64_t kb = 0;
+        meminfo >> kb;
+        if (key == "MemAvailable:") {
+            headroom = kb * 1024;
+            break;
         }
+        meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
     }
-    std::sort(entries.begin(), entries.end());
-    for (const auto& rel : entries) {
-        auto full_path = dir / rel;
-        hash = hash.combineUnordered(hashString(rel.string()).combine(hashFile(full_path)));
+    forEachCgroup([&](const Dir& dir) {
+        auto max = readCgroupValue(dir / "memory.max");
+        auto current = readCgroupValue(dir / "memory.current");
+        if (!max || !current) return;
+        uint64_t file = 0;
+        std::ifstream stat{dir / "memory.stat"};
+        for (std::string key; stat >> key;) {
+            uint64_t bytes = 0;
+            stat >> bytes;
+            if (key == "inactive_file" || key == "active_file") file += bytes;
+        }
+        auto used = *current - std::min(*current, file);
+        headroom = std::min(headroom, *max > used ? *max - used : 0);
+    });
+    return headroom;
+}
+
+// runs fn(i) for every i in [0, n) on up to all available cpus, calling thread included. used for bulk file work
+// outside of scheduler, so it does not take job slots
+inline void parallelFor(size_t n, const std::function<void(size_t)>& fn, size_t min_per_thread = 32) {
+    static const size_t cpus = static_cast<size_t>(availableCpus());
+    auto threads_count = std::min(cpus, (n + min_per_thread - 1) / min_per_thread);
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+        for (size_t i = next++; i < n; i = next++) fn(i);
+    };
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < threads_count; t++) threads.emplace_back(work);
+    work();
+    for (auto& t : threads) t.join();
+}
+
+// regular files below dir (links to them included), relative to it, in no particular order. entries are read with
+// getdents64, which tells their type without stat for most filesystems, and subdirectories are read by several threads
+// at once. like recursive_directory_iterator, links to directories are not followed by default
+inline std::vector<Path> walkDirFiles(const Dir& dir, bool follow_dir_links = false, bool skip_denied = false) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Path> queue{Path{}}; // directories to read, relative to dir
+    size_t busy = 0;
+    std::vector<Path> files;
+
+    auto read_dir = [&](const Path& rel, std::vector<Path>* subdirs, std::vector<Path>* found) {
+        int fd = ::open((dir / rel).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            if (skip_denied && errno == EACCES) return;
+            panic("Failed to open directory %s: %s\n", (dir / rel).c_str(), strerror(errno));
+        }
+        alignas(8) char buf[32 * 1024];
+        while (true) {
+            auto n = ::syscall(SYS_getdents64, fd, buf, sizeof(buf));
+            if (n < 0) panic("Failed to read directory %s: %s\n", (dir / rel).c_str(), strerror(errno));
+            if (n == 0) break;
+            for (long pos = 0; pos < n;) {
+                // struct linux_dirent64 is not exposed by libc: u64 ino, s64 off, u16 reclen, u8 type, name
+                const char* entry = buf + pos;
+                uint16_t reclen = 0;
+                std::memcpy(&reclen, entry + 16, sizeof(reclen));
+                auto type = static_cast<unsigned char>(entry[18]);
+                const char* name = entry + 19;
+                pos += reclen;
+                if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) continue;
+                struct stat st = {};
+                if (type == DT_UNKNOWN) { // filesystem does not fill d_type
+                    if (::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                    type = S_ISLNK(st.st_mode) ? DT_LNK : S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR : DT_UNKNOWN;
+                }
+                if (type == DT_LNK) {
+                    if (::fstatat(fd, name, &st, 0) != 0) continue; // dangling
+                    type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) && follow_dir_links ? DT_DIR : DT_UNKNOWN;
+                }
+                if (type == DT_REG) found->push_back(rel / name);
+                if (type == DT_DIR) subdirs->push_back(rel / name);
+            }
+        }
+        ::close(fd);
+    };
+
+    auto work = [&]() {
+        std::vector<Path> subdirs, found;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&]() { return !queue.empty() || busy == 0; });
+            if (queue.empty()) return; // nothing left and nobody may add more
+            auto rel = std::move(queue.back());
+            queue.pop_back();
+            busy++;
+            lock.unlock();
+            subdirs.clear();
+            found.clear();
+            read_dir(rel, &subdirs, &found);
+            lock.lock();
+            busy--;
+            files.insert(files.end(), std::make_move_iterator(found.begin()), std::make_move_iterator(found.end()));
+            queue.insert(queue.end(), std::make_move_iterator(subdirs.begin()), std::make_move_iterator(subdirs.end()));
+            cv.notify_all();
+        }
+    };
+    static const int cpus = std::min(availableCpus(), 8); // more threads do not help, directory reads are quick
+    std::vector<std::thread> threads;
+    for (int t = 1; t < cpus; t++) threads.emplace_back(work);
+    work();
+    for (auto& t : threads) t.join();
+    return files;
+}
+
+#ifdef BPP_HAVE_IO_URING
+// minimal io_uring over raw syscalls, so liburing is not needed
+struct IoUring {
+    int fd = -1;
+    io_uring_params params = {};
+    void* sq_ptr = MAP_FAILED;
+    void* cq_ptr = MAP_FAILED;
+    size_t sq_len = 0;
+    size_t cq_len = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned* cq_mask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned local_tail = 0;
+    unsigned to_submit = 0;
+
+    bool init(unsigned entries) {
+        fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) return false;
+        sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_len = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sq_len = cq_len = std::max(sq_len, cq_len);
+        sq_ptr = ::mmap(nullptr, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) return false;
+        cq_ptr = single ? sq_ptr : ::mmap(nullptr, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) return false;
+        sqes = static_cast<io_uring_sqe*>(::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) return false;
+        auto* sq = static_cast<char*>(sq_ptr);
+        auto* cq = static_cast<char*>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        local_tail = *sq_tail;
+        return true;
+    }
+
+    ~IoUring() {
+        if (sqes != MAP_FAILED) ::munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) ::munmap(cq_ptr, cq_len);
+        if (sq_ptr != MAP_FAILED) ::munmap(sq_ptr, sq_len);
+        if (fd >= 0) ::close(fd);
+    }
+
+    // nullptr if submission queue is full
+    io_uring_sqe* nextSqe() {
+        if (local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= params.sq_entries) return nullptr;
+        auto idx = local_tail & *sq_mask;
+        std::memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+        sq_array[idx] = idx;
+        local_tail++;
+        to_submit++;
+        return &sqes[idx];
+    }
+
+    // submits queued entries and waits until at least one completion is available
+    bool submitAndWait() {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        auto ret = ::syscall(__NR_io_uring_enter, fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0) return errno == EINTR;
+        to_submit -= static_cast<unsigned>(ret);
+        return true;
+    }
+
+    bool popCqe(io_uring_cqe* out) {
+        auto head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) return false;
+        *out = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+// hashes files at indices of todo with openat, statx and read requests of up to 64 files in flight, every file is
+// hashed as soon as its read completes. files it could not handle (errors, big files) are left in *todo for the caller.
+// false if io_uring is not available
+inline bool hashFilesIoUring(const std::vector<Path>& paths, std::vector<Hash>* hashes, std::vector<size_t>* todo) {
+    static std::atomic<bool> unavailable = false; // seccomp, io_uring_disabled sysctl or old kernel
+    if (unavailable) return false;
+    IoUring ring;
+    if (!ring.init(256)) {
+        unavailable = true;
+        return false;
+    }
+    constexpr size_t max_active = 64; // each file has at most 2 requests in flight, fits into the ring
+    constexpr uint64_t max_size = 1 << 20; // bigger files are rare among sources, they are read by hashFile
+    enum Op : uint64_t { Open, Statx, Read };
+    struct File {
+        size_t index = 0;
+        int fd = -1;
+        int waiting = 0;
+        bool failed = false;
+        struct statx stx = {};
+        std::string content;
+        size_t done = 0;
+    };
+    std::vector<File> files(todo->size());
+    std::vector<size_t> left;
+    size_t next = 0, active = 0;
+    auto* rt = runtime();
+
+    auto read_rest = [&](size_t slot) {
+        auto& f = files[slot];
+        auto* sqe = ring.nextSqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = f.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(f.content.data() + f.done);
+        sqe->len = static_cast<uint32_t>(f.content.size() - f.done);
+        sqe->off = f.done;
+        sqe->user_data = slot << 2 | Read;
+        f.waiting++;
+    };
+    auto finish = [&](size_t slot) {
+        auto& f = files[slot];
+        if (f.fd >= 0) ::close(f.fd);
+        active--;
+        if (f.failed) {
+            left.push_back(f.index);
+            return;
+        }
+        f.content.resize(f.done); // file may have shrunk
+        (*hashes)[f.index] = hashBytes(Hash{}, f.content.data(), f.content.size());
+        std::string{}.swap(f.content);
+        rt->hash_cache.put(paths[f.index], FileHashEntry{
+            .hash = (*hashes)[f.index],
+            .mtime_ns = static_cast<int64_t>(f.stx.stx_mtime.tv_sec) * 1000000000 + f.stx.stx_mtime.tv_nsec,
+            .size = f.stx.stx_size,
+        });
+    };
+
+    while (next < files.size() || active > 0) {
+        for (; next < files.size() && active < max_active; next++, active++) {
+            auto& f = files[next];
+            f.index = (*todo)[next];
+            auto* open_sqe = ring.nextSqe();
+            open_sqe->opcode = IORING_OP_OPENAT;
+            open_sqe->fd = AT_FDCWD;
+            open_sqe->addr = reinterpret_cast<uint64_t>(paths[f.index].c_str());
+            open_sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            open_sqe->user_data = next << 2 | Open;
+            auto* statx_sqe = ring.nextSqe();
+            statx_sqe->opcode = IORING_OP_STATX;
+            statx_sqe->fd = AT_FDCWD;
+            statx_sqe->addr = reinterpret_cast<uint64_t>(paths[f.index].c_str());
+            statx_sqe->len = STATX_SIZE | STATX_MTIME;
+            statx_sqe->off = reinterpret_cast<uint64_t>(&f.stx);
+            statx_sqe->user_data = next << 2 | Statx;
+            f.waiting = 2;
+        }
+        if (!ring.submitAndWait()) panic("io_uring_enter failed: %s\n", strerror(errno));
+        io_uring_cqe cqe;
+        while (ring.popCqe(&cqe)) {
+            auto slot = static_cast<size_t>(cqe.user_data >> 2);
+            auto& f = files[slot];
+            f.waiting--;
+            if (cqe.res < 0) f.failed = true;
+            switch (cqe.user_data & 3) {
+                case Open:
+                    if (cqe.res >= 0) f.fd = cqe.res;
+                    break;
+                case Statx:
+                    break;
+                case Read:
+                    if (cqe.res > 0) f.done += static_cast<size_t>(cqe.res);
+                    if (cqe.res > 0 && f.done < f.content.size()) {
+                        read_rest(slot);
+                        continue;
+                    }
+                    finish(slot); // eof or error
+                    continue;
+            }
+            if (f.waiting > 0) continue; // other of open and statx is still in flight
+            if (!f.failed && f.stx.stx_size > max_size) f.failed = true;
+            if (f.failed || f.stx.stx_size == 0) {
+                finish(slot);
+                continue;
+            }
+            f.content.resize(f.stx.stx_size);
+            read_rest(slot);
+        }
+    }
+    *todo = std::move(left);
+    return true;
+}
+#endif
+
+// same as hashFile for every path. with --io-uring (see hashFilesIoUring) requests for many files are in flight at
+// once, that hides latency of cold page cache and network filesystems. otherwise, or if io_uring is not available,
+// files are hashed by threads of parallelFor
+inline std::vector<Hash> hashFiles(const std::vector<Path>& paths) {
+    std::vector<Hash> hashes(paths.size());
+    std::vector<size_t> todo;
+    auto* rt = runtime();
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (auto cached = rt->hash_cache.find(paths[i])) hashes[i] = *cached;
+        else todo.push_back(i);
+    }
+#ifdef BPP_HAVE_IO_URING
+    if (rt->io_uring && !todo.empty()) hashFilesIoUring(paths, &hashes, &todo);
+#endif
+    parallelFor(todo.size(), [&](size_t i) { hashes[todo[i]] = hashFile(paths[todo[i]]); });
+    return hashes;
+}
+
+inline Hash hashDirRec(Dir dir) {
+    auto entries = walkDirFiles(dir);
+    std::vector<Path> paths;
+    for (const auto& rel : entries) paths.push_back(dir / rel);
+    auto hashes = hashFiles(paths);
+    Hash hash{};
+    for (size_t i = 0; i < entries.size(); i++) { // sum does not depend on order of walk
+        hash = hash.combineUnordered(hashString(entries[i].string()).combine(hashes[i]));
     }
     return hash;
 }
@@ -473,16 +1462,21 @@ static void writeEntireFile(Path p, std::string content) {
     fout.close();
 }
 
-// panic on error
-static std::vector<Path> listFiles(Dir d, std::filesystem::directory_options opts = std::filesystem::directory_options::none) try {
-    std::vector<Path> res;
-    for (auto entry : std::filesystem::recursive_directory_iterator{d, opts}) {
-        if (entry.is_regular_file()) res.push_back(entry.path());
-    }
-
+// panic on error, result is sorted
+static std::vector<Path> listFiles(Dir d, std::filesystem::directory_options opts = std::filesystem::directory_options::none) {
+    using o = std::filesystem::directory_options;
+    auto res = walkDirFiles(d, (opts & o::follow_directory_symlink) != o::none, (opts & o::skip_permission_denied) != o::none);
+    for (auto& path : res) path = d / path;
+    std::sort(res.begin(), res.end());
     return res;
-} catch (const std::exception& e) {
-    panic("Listing files in directory %s failed: %s", d.c_str(), e.what());
+}
+
+// records component of key of step being hashed by this thread, does nothing outside of Build::beginKeyItems
+inline void explainKeyItem(const char* kind, std::string_view what, Hash h) {
+    auto* rt = runtime();
+    std::lock_guard<std::mutex> lock(rt->explain_mutex);
+    auto it = rt->explain_items.find(std::this_thread::get_id());
+    if (it != rt->explain_items.end()) it->second.push_back({kind, std::string{what}, h.value});
 }
 
 struct HasherOpts {
@@ -495,9 +1489,21 @@ struct HasherOpts {
 inline std::function<Hash(Hash)> inputsHasher(HasherOpts opts) {
     return [opts](Hash h) {
         h = h.combine(hashString(opts.stable_id));
-        for (auto dir : opts.dirs) h = h.combine(hashDirRec(dir));
-        for (auto file : opts.files) h = h.combine(hashFile(file));
-        for (auto str : opts.strings) h = h.combine(hashString(str));
+        explainKeyItem("id", opts.stable_id, hashString(opts.stable_id));
+        for (auto dir : opts.dirs) {
+            auto dir_h = hashDirRec(dir);
+            explainKeyItem("dir", dir.string(), dir_h);
+            h = h.combine(dir_h);
+        }
+        for (auto file : opts.files) {
+            auto file_h = hashFile(file);
+            explainKeyItem("file", file.string(), file_h);
+            h = h.combine(file_h);
+        }
+        for (auto str : opts.strings) {
+            explainKeyItem("string", str, hashString(str));
+            h = h.combine(hashString(str));
+        }
         return h;
     };
 };
@@ -511,8 +1517,17 @@ struct CompileCommandsEntry {
 using Clock = std::chrono::high_resolution_clock;
 using Timestamp = std::chrono::time_point<Clock>;
 
-inline void commandReplacePatternIfExist(std::string* cmd, std::string_view pattern, std::vector<Path> paths) {
-    if (auto pos = cmd->find(pattern); pos != std::string::npos) {
+inline Path batchOutputName(std::string pattern, const Path& input) {
+    for (auto [key, value] : {std::pair{"{stem}", input.stem().string()}, std::pair{"{name}", input.filename().string()}}) {
+        for (auto pos = pattern.find(key); pos != std::string::npos; pos = pattern.find(key, pos + value.size())) {
+            pattern.replace(pos, std::string_view{key}.size(), value);
+        }
+    }
+    return pattern;
+}
+
+inline void commandReplacePatternIfExist(std::string* cmd, std::string_view pattern, std::vector<Path> paths) {
+    if (auto pos = cmd->find(pattern); pos != std::string::npos) {
         std::string replacement;
         for (const auto& p : paths) {
             replacement += " \"" + escapeStringBash(p.string()) + "\"";
@@ -525,6 +1540,137 @@ struct Url {
     std::string value;
 };
 
+// compact format of tool's own state files inside of cache dir
+// integers are written as decimal followed by space, strings as "<size>:<bytes>"
+struct CacheWriter {
+    std::string buf;
+
+    void u64(uint64_t v) {
+        buf += std::to_string(v);
+        buf += ' ';
+    }
+
+    void str(std::string_view v) {
+        buf += std::to_string(v.size());
+        buf += ':';
+        buf += v;
+    }
+};
+
+// never panics, sets ok to false on malformed input instead
+struct CacheReader {
+    std::string_view data;
+    size_t pos = 0;
+    bool ok = true;
+
+    uint64_t u64() {
+        return number(' ');
+    }
+
+    std::string str() {
+        auto size = number(':');
+        if (!ok || size > data.size() - pos) {
+            ok = false;
+            return {};
+        }
+        auto res = std::string{data.substr(pos, size)};
+        pos += size;
+        return res;
+    }
+
+    bool atEnd() const {
+        return !ok || pos >= data.size();
+    }
+
+private:
+    uint64_t number(char terminator) {
+        if (!ok) return 0;
+        uint64_t v = 0;
+        auto end = data.data() + data.size();
+        auto res = std::from_chars(data.data() + pos, end, v);
+        if (res.ec != std::errc() || res.ptr == end || *res.ptr != terminator) {
+            ok = false;
+            return 0;
+        }
+        pos = res.ptr - data.data() + 1;
+        return v;
+    }
+};
+
+// used to bring caches filled by forked build process back to the long-living parent (see Build::serve)
+inline void exportRuntimeCaches(CacheWriter* w) {
+    auto* rt = runtime();
+    {
+        CacheWriter entries;
+        uint64_t count = 0;
+        rt->hash_cache.forEach([&](const std::filesystem::path& path, const FileHashEntry& entry) {
+            entries.str(path.string());
+            entries.u64(entry.hash.value);
+            entries.u64(static_cast<uint64_t>(entry.mtime_ns));
+            entries.u64(entry.size);
+            count++;
+        });
+        w->u64(count);
+        w->buf += entries.buf;
+    }
+    std::lock_guard<std::mutex> lock(rt->depfile_mutex);
+    w->u64(rt->depfile_cache.size());
+    for (const auto& [depfile, deps] : rt->depfile_cache) {
+        w->str(depfile.string());
+        w->u64(deps.size());
+        for (const auto& dep : deps) w->str(dep.string());
+    }
+}
+
+inline void importRuntimeCaches(CacheReader* r) {
+    auto* rt = runtime();
+    {
+        auto count = r->u64();
+        for (uint64_t i = 0; i < count && r->ok; i++) {
+            auto path = r->str();
+            FileHashEntry entry;
+            entry.hash.value = r->u64();
+            entry.mtime_ns = static_cast<int64_t>(r->u64());
+            entry.size = r->u64();
+            if (r->ok) rt->hash_cache.put(path, entry);
+        }
+    }
+    std::lock_guard<std::mutex> lock(rt->depfile_mutex);
+    auto count = r->u64();
+    for (uint64_t i = 0; i < count && r->ok; i++) {
+        auto depfile = r->str();
+        std::vector<std::filesystem::path> deps(r->u64());
+        for (auto& dep : deps) {
+            if (r->ok) dep = r->str();
+        }
+        if (r->ok) rt->depfile_cache[depfile] = deps;
+    }
+}
+
+inline bool sendAll(int fd, const void* data, size_t size) {
+    auto* ptr = static_cast<const char*>(data);
+    while (size > 0) {
+        auto n = ::send(fd, ptr, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+inline bool recvAll(int fd, void* data, size_t size) {
+    auto* ptr = static_cast<char*>(data);
+    while (size > 0) {
+        auto n = ::recv(fd, ptr, size, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
 // main structure build script will operate on
 struct Build {
 private:
@@ -534,6 +1680,10 @@ private:
     bool verbose = false;
     bool silent = false;
     bool report_help = false;
+    bool server_mode = false;
+    bool watch_mode = false;
+    bool explain = false; // --explain
+    bool time_trace = false; // --time-trace
 
     Dir root;
     Dir cache;
@@ -544,20 +1694,155 @@ private:
     std::list<std::pair<RunOptions, Step*>> runs;
     std::list<Step> steps;
     std::list<Obj> objs;
+    std::list<Pch> pchs;
+    std::list<BatchCommand> batch_commands;
+    std::mutex compiler_infos_mutex;
+    std::unordered_map<std::string, CompilerInfo> compiler_infos; // by compile driver
+    // compilers detected by previous runs, trusted while resolved binary and system include dirs keep their mtimes
+    struct CompilerRecord {
+        CompilerInfo info;
+        std::vector<std::pair<Path, int64_t>> stamps;
+    };
+    static constexpr uint64_t compiler_records_version = 1;
+    std::unordered_map<std::string, CompilerRecord> compiler_records;
+    bool compiler_records_loaded = false;
+    std::unordered_map<Obj*, ModuleUnit> module_units; // objs of targets with modules enabled
+    struct ModuleBmi {
+        Obj* provider = nullptr;
+        Step* step = nullptr; // directory with built module interface
+    };
+    std::map<std::string, ModuleBmi> module_bmis; // by logical name
     std::list<Exe> exes;
     std::list<Lib> libs;
     std::list<SubProj> sub_builds;
     std::vector<std::pair<Step*, Path>> install_list;
     std::vector<CompileCommandsEntry> compile_commands_list;
+    void* script_handle = nullptr; // handle to "dlopen-ed" build script, if it was changed since tool was linked
+    Hash self_hash{0}; // hash of build script and everything it includes
+    std::vector<std::pair<Path, Hash>> self_deps; // build script and everything it includes
+
+    // graph snapshot state, see snapshot_graph
+    enum class GraphCall : uint64_t { Exe = 1, Lib, File, Obj, RunExe, Install, InstallHeaders, Fetch, Unpack, CMake, CMakeTarball, BatchCommand };
+    static constexpr uint64_t graph_snapshot_version = 7;
+    CacheWriter graph_calls; // outermost builtin calls made by configure(), in order
+    std::vector<std::pair<std::string, Hash>> glob_results; // patterns configure() globbed, with hash of what they matched
+    int graph_call_depth = 0;
+    bool graph_snapshotable = true; // false once script adds something that replaying graph_calls can't reproduce
+    bool graph_loaded = false;
+    Hash graph_key{0};
+    std::vector<Step*> step_order; // all steps in order of creation, index is stable id of step inside of snapshot
+    std::unordered_map<Step*, uint64_t> step_ids;
+
+    // GNU make jobserver, shared by our workers and nested builds (make, ninja, cmake --build). see setupJobserver
+    int jobserver_read_fd = -1;
+    int jobserver_write_fd = -1;
+    Path jobserver_fifo; // non-empty if we are the jobserver
+    int jobserver_inherited_fd = -1; // blocking fd of our fifo for children that do not know about fifo jobserver
+    std::atomic<bool> jobserver_implicit_taken = false; // every jobserver client owns one token without reading it
+
+    // listings of directories seen by glob(), keyed by path relative to root. listing is read again only when mtime of
+    // its directory changed, that happens when entries are added, removed or renamed
+    enum class EntryKind : uint8_t { Other, File, Dir };
+    struct DirListing {
+        int64_t mtime_ns = 0; // 0 if listing can not be trusted on next run
+        std::vector<std::pair<std::string, EntryKind>> entries;
+        bool used = false; // only listings used by this run are saved
+    };
+    static constexpr uint64_t dir_listings_version = 1;
+    std::unordered_map<std::string, DirListing> dir_listings;
+    bool dir_listings_loaded = false;
+    bool dir_listings_dirty = false;
+
+    // token hashes of sources by hash of their bytes, so file is lexed only once per content. see sourceHash. bump
+    // version whenever normalizeSourceTokens output changes, stored hashes of older lexer must not be reused
+    static constexpr uint64_t token_hashes_version = 2;
+    std::mutex token_hashes_mutex;
+    struct TokenHash {
+        uint64_t hash = 0;
+        bool used = false;
+    };
+    std::unordered_map<uint64_t, TokenHash> token_hashes[2]; // by keep_lines
+    bool token_hashes_loaded = false;
+    bool token_hashes_dirty = false;
+
+    // resources used by steps on previous runs, keyed by Step::unique_name
+    struct StepHistory {
+        uint64_t peak_rss_kb = 0;
+        uint64_t duration_ms = 0;
+    };
+    static constexpr uint64_t step_history_version = 2;
+    std::unordered_map<std::string, StepHistory> step_history;
+    std::unordered_map<std::string, StepHistory> step_history_updates; // guarded by admission_mutex
+    std::unordered_map<std::string, uint64_t> step_name_uses; // see assignUniqueName
+    struct StepReport {
+        Step* step = nullptr;
+        uint64_t wall_us = 0;
+        ProcessUsage usage;
+    };
+    std::vector<StepReport> step_reports; // performed step actions, guarded by admission_mutex
+    Path report_path; // --report=<path>
+    // key components of steps as they were when steps were last performed, keyed by Step::unique_name
+    struct KeyRecord {
+        std::vector<KeyItem> items;
+        bool cached = true; // false if step left no artifact, such step (e.g. install) is performed on every run
+    };
+    static constexpr uint64_t key_records_version = 2;
+    std::unordered_map<std::string, KeyRecord> key_records;
+    std::unordered_map<std::string, KeyRecord> key_record_updates; // guarded by key_records_mutex
+    std::mutex key_records_mutex;
+    std::string events_spec; // --events=fd:<n>|<path>
+    int events_fd = -1;
+    bool events_fd_owned = false;
+    Clock::time_point events_start;
+    static inline Build* events_build = nullptr; // for reporting failed build at exit
+
+    // single status line replacing per-step output when stdout is terminal
+    struct Progress {
+        bool enabled = false;
+        std::mutex mutex;
+        size_t total = 0;
+        size_t finished = 0;
+        size_t cache_hits = 0;
+        size_t cache_misses = 0;
+        size_t unchecked = 0; // not known yet whether they will be performed
+        uint64_t unchecked_expected_us = 0; // sum of their durations from history
+        uint64_t default_expected_us = 0; // for steps without history
+        std::unordered_map<Step*, std::pair<Clock::time_point, uint64_t>> running; // start and expected duration
+        std::unordered_map<std::thread::id, Step*> thread_steps; // what running steps are performed by
+        Clock::time_point start;
+        Clock::time_point last_draw;
+    } progress;
+    // memory admission, steps are started only when recorded peak memory of them fits into free memory
+    std::mutex admission_mutex;
+    std::condition_variable admission_cv;
+    int admitted_steps = 0;
+
+    struct Pool {
+        int depth = 0;
+        bool takes_job_slot = true;
+    };
+    std::map<std::string, Pool> pools = {
+        {"link", {.depth = 2, .takes_job_slot = true}}, // links are memory hungry, LTO ones especially
+        {"io", {.depth = 0, .takes_job_slot = false}},
+    };
 
     bool build_phase_started = false; // for asserts
+    std::thread::id dyndep_thread = {}; // thread running Step::dyndep callback, it may edit graph during build
 public:
     Step* install_step = nullptr;
     Step* build_all_step = nullptr;
     Dir out;
     std::vector<std::string> cli_args;
     bool dump_compile_commands = false;
+    SourceHashing source_hashing = SourceHashing::Bytes;
+    // objs are keyed by their preprocessed source and flags affecting code generation, so targets and variants that differ
+    // only in include paths or unused defines share objs. see preprocessedObjKey
+    bool preprocessed_obj_keys = false;
     int max_parallel_jobs = -1;
+    // when set, configured graph is saved into cache and next runs with the same build script, options and cli args load it
+    // instead of calling configure(). only builtin steps can be restored, so script that adds its own steps (addStep, addRun)
+    // or subprojects is configured every run. anything configure() reads besides options (env, files listing) is not tracked
+    bool snapshot_graph = false;
 
     std::optional<Path> static_link_tool; // if empty, static linking is not supported
     CXXFlags global_flags = {};
@@ -572,6 +1857,7 @@ public:
         saved_argv[argc] = nullptr;
 
         setupDirectories(env_root, env_cache, env_prefix);
+        loadStepHistory();
 
         detectStaticLinkTool();
 
@@ -619,11 +1905,15 @@ public:
         parseOldOptions();
         parseArgs(); // depends on old_options
 
+        graph_key = graphKey();
+
         // global install step merges together everything this project installs and packs it into one directory
+        graph_call_depth++; // root steps are created on every run, so they are not recorded
         install_step = addStep({.name = "install", .desc = "Install targets", .phony = true, .silent = true});
         install_step->inputs_hash = inputsHasher({.stable_id = "install-all"});
 
         build_all_step = addStep({.name = "build", .desc = "Build all targets", .silent = true});
+        graph_call_depth--;
 
         // push one compile command for self-build
         auto self_path = (root / "build.cpp").string();
@@ -636,23 +1926,99 @@ public:
     }
 
     void postConfigure() {
+        if (dir_listings_dirty) saveDirListings();
+        resolveModules();
         // create compile_commands list at the end of configuration to be more predictable for user
         std::vector<Path> seen_sources;
         for (const auto& obj : objs) {
-            // NOTE: In case user compiles same source into multiple objs with different flags, only first one is recorded and emited with no warnings
-            if (std::find(seen_sources.begin(), seen_sources.end(), root / obj.opts.source) != seen_sources.end()) continue; // already recorded
-            seen_sources.push_back(root / obj.opts.source);
-
-            auto comp_cmd = std::string{};
-            cmdRenderCompileObj(&comp_cmd, obj.opts, {obj.opts.source}, {}, "");
-            auto cce = CompileCommandsEntry{
-                .command = comp_cmd,
-                .file = root / obj.opts.source,
-                .dir = root,
-            };
-            compile_commands_list.push_back(cce);
+            if (obj.opts.generated_source) continue; // does not exist until build
+            auto sources = obj.unity_sources.empty() ? std::vector<Path>{obj.opts.source} : obj.unity_sources; // ides need real sources
+            for (const auto& source : sources) {
+                // NOTE: In case user compiles same source into multiple objs with different flags, only first one is recorded and emited with no warnings
+                if (std::find(seen_sources.begin(), seen_sources.end(), root / source) != seen_sources.end()) continue; // already recorded
+                seen_sources.push_back(root / source);
+
+                auto comp_cmd = std::string{};
+                cmdRenderCompileObj(&comp_cmd, obj.opts, {source}, {}, "");
+                auto cce = CompileCommandsEntry{
+                    .command = comp_cmd,
+                    .file = root / source,
+                    .dir = root,
+                };
+                compile_commands_list.push_back(cce);
+            }
         }
         if (dump_compile_commands) renderAndDumpCompileCommandsJson(root / "compile_commands.json");
+        if (snapshot_graph && !graph_loaded) saveGraphSnapshot();
+    }
+
+    // restores graph saved by previous run with the same graph key, returns false if there is none and configure() must run
+    bool loadGraphSnapshot() {
+        std::error_code ec;
+        if (!std::filesystem::exists(graphSnapshotPath(), ec)) return false;
+        auto content = readEntireFile(graphSnapshotPath());
+        CacheReader r{content};
+        if (r.u64() != graph_snapshot_version || r.u64() != graph_key.value) return false;
+        auto globs_count = r.u64();
+        for (uint64_t i = 0; i < globs_count && r.ok; i++) {
+            auto pattern = r.str();
+            auto expected = r.u64();
+            if (r.ok && hashGlob(globFiles(pattern)).value != expected) {
+                if (verbose) blog("Build graph snapshot is outdated: files matching %s changed\n", pattern.c_str());
+                return false;
+            }
+        }
+        auto calls = r.str();
+        if (!r.ok) return false;
+
+        CacheReader calls_reader{calls};
+        while (!calls_reader.atEnd()) replayGraphCall(&calls_reader);
+        if (!calls_reader.ok) panic("Graph snapshot %s is corrupted, remove it\n", graphSnapshotPath().c_str());
+
+        // builtin steps may be tweaked after creation, so final state of everything is restored on top
+        if (r.u64() != step_order.size()) panic("Graph snapshot %s does not match build script, remove it\n", graphSnapshotPath().c_str());
+        for (auto* step : step_order) {
+            std::vector<uint64_t> deps;
+            snap(&r, &step->opts);
+            snap(&r, &deps);
+            snap(&r, &step->inputs);
+            step->deps.clear();
+            for (auto id : deps) step->deps.push_back(stepById(&r, id));
+        }
+        if (r.u64() != objs.size()) r.ok = false;
+        for (auto& obj : objs) snap(&r, &obj.opts);
+        if (r.u64() != exes.size()) r.ok = false;
+        for (auto& exe : exes) snap(&r, &exe.opts);
+        if (r.u64() != libs.size()) r.ok = false;
+        for (auto& lib : libs) snap(&r, &lib.opts);
+        snap(&r, &dump_compile_commands);
+        snap(&r, &source_hashing);
+        snap(&r, &preprocessed_obj_keys);
+        snap(&r, &global_flags);
+        snap(&r, &global_lib_exe_flags);
+        snap(&r, &static_link_tool);
+        auto pools_count = r.u64();
+        for (uint64_t i = 0; i < pools_count && r.ok; i++) {
+            auto name = r.str();
+            Pool pool{.depth = static_cast<int>(static_cast<int64_t>(r.u64()))};
+            snap(&r, &pool.takes_job_slot);
+            pools[name] = pool;
+        }
+        if (!r.ok) panic("Graph snapshot %s is corrupted, remove it\n", graphSnapshotPath().c_str());
+
+        graph_loaded = true;
+        if (verbose) blog("Loaded configured build graph from %s\n", graphSnapshotPath().c_str());
+        return true;
+    }
+
+    // files matching pattern relative to root, sorted. "*" and "?" match inside of one path component, "**" matches any
+    // number of directories. hidden entries are matched only explicitly, cache and out dirs are skipped. directory
+    // listings are cached with their mtimes, so no-op run only stats directories. unlike listFiles, result is checked
+    // when graph snapshot is loaded
+    std::vector<Path> glob(const std::string& pattern) {
+        auto files = globFiles(pattern);
+        glob_results.push_back({pattern, hashGlob(files)});
+        return files;
     }
 
     template <typename T>
@@ -701,15 +2067,24 @@ public:
     }
 
     Exe* addExe(ExeOpts opts, std::vector<Path> sources = {}) {
-        if (build_phase_started) panic("Cannot add new executable \"%s\" after build phase has started\n", opts.name.c_str());
+        if (!graphEditable()) panic("Cannot add new executable \"%s\" after build phase has started\n", opts.name.c_str());
+        GraphCallGuard call{this, GraphCall::Exe};
+        if (call.w) {
+            snap(call.w, opts);
+            snap(call.w, sources);
+        }
 
-        auto step = addStep({.name = opts.name, .desc = opts.desc});
+        auto step = addStep({.name = opts.name, .desc = opts.desc, .pool = "link"});
         exes.push_back({.opts = opts, .link_step = step});
         auto exe = &exes.back();
         build_all_step->deps.push_back(step);
 
-        for (auto src : sources) {
-            auto obj = addObj({.flags = opts.obj, .source = src, .opt_whole = &exe->opts.exe_flags}, true);
+        auto obj_opts = ObjOpts{.flags = opts.obj, .opt_whole = &exe->opts.exe_flags, .modules = opts.modules};
+        obj_opts.pch = addPch(step->opts.name, opts.pch, obj_opts, sources);
+        for (auto* obj : addTargetObjs(step->opts.name, opts.unity, obj_opts, sources)) {
+            step->inputs.push_back({.step = obj->step});
+        }
+        for (auto* obj : addGeneratedObjs(obj_opts, opts.generated_sources)) {
             step->inputs.push_back({.step = obj->step});
         }
 
@@ -718,7 +2093,7 @@ public:
             std::string cmd;
             cmdRenderLinkExe(&cmd, exe->opts, completedInputs(exe->link_step), out);
             if (verbose) log("Linking exe cmd: %s\n", cmd.c_str());
-            int res = std::system(cmd.c_str());
+            int res = runCmd(cmd);
             if (res != 0) panic("Link step command failed with code %d", res);
         };
 
@@ -726,15 +2101,25 @@ public:
     }
 
     Lib* addLib(LibraryOpts opts, std::vector<Path> sources = {}) {
-        if (build_phase_started) panic("Cannot add new library \"%s\" after build phase has started\n", opts.name.c_str());
-        auto step = addStep({.name = opts.name, .desc = opts.desc});
+        if (!graphEditable()) panic("Cannot add new library \"%s\" after build phase has started\n", opts.name.c_str());
+        GraphCallGuard call{this, GraphCall::Lib};
+        if (call.w) {
+            snap(call.w, opts);
+            snap(call.w, sources);
+        }
+
+        auto step = addStep({.name = opts.name, .desc = opts.desc, .pool = "link"});
         build_all_step->deps.push_back(step);
         libs.push_back({.opts = opts, .link_step = step});
         auto lib = &libs.back();
         step->opts.name = lib->libName();
 
-        for (auto src : sources) {
-            auto obj = addObj({.flags = opts.obj, .source = src}, true);
+        auto obj_opts = ObjOpts{.flags = opts.obj, .modules = opts.modules};
+        obj_opts.pch = addPch(step->opts.name, opts.pch, obj_opts, sources);
+        for (auto* obj : addTargetObjs(step->opts.name, opts.unity, obj_opts, sources)) {
+            step->inputs.push_back({.step = obj->step});
+        }
+        for (auto* obj : addGeneratedObjs(obj_opts, opts.generated_sources)) {
             step->inputs.push_back({.step = obj->step});
         }
 
@@ -743,19 +2128,647 @@ public:
             std::string cmd;
             cmdRenderLinkLib(&cmd, lib->opts, completedInputs(lib->link_step), out);
             if (verbose) log("Linking lib cmd: %s\n", cmd.c_str());
-            int res = std::system(cmd.c_str());
+            int res = runCmd(cmd);
             if (res != 0) panic("Link step command failed with code %d", res);
         };
 
         return lib;
     }
 
+    // target is name of link step, like in addTargetObjs, so exe and lib of the same name get separate headers
+    std::optional<LazyPath> addPch(const std::string& target, const PchOpts& opts, const ObjOpts& obj_opts, const std::vector<Path>& sources) {
+        if (opts.header.empty() && !opts.automatic) return std::nullopt;
+        auto step = addStep({.name = target + "-pch", .desc = "Precompiled header of " + target, .silent = true});
+        pchs.push_back({.target = target, .opts = opts, .obj = obj_opts, .sources = sources, .step = step});
+        auto pch = &pchs.back();
+        pch->obj.source = cache / "pch" / target / "pch.hpp";
+
+        step->inputs_hash = [this, pch](Hash h) {
+            writePchStub(pch);
+            h = h.combine(hashObjOpts(pch->obj));
+            h = h.combine(buildEntireSourceFileHashCached(pch->obj, pch->obj.source));
+            return h;
+        };
+        step->action = [this, pch](Output out) {
+            std::error_code ec;
+            std::filesystem::create_directories(out, ec);
+            std::filesystem::copy_file(pch->obj.source, out / "pch.hpp", ec);
+            if (ec) panic("Failed to copy precompiled header stub to %s: %s\n", out.c_str(), ec.message().c_str());
+            if (pchHeaders(pch).empty()) return; // nothing to precompile, stub is included as is
+
+            auto driver = applyFlagsOverlay(global_flags, &pch->obj.flags).compile_driver;
+            std::string cmd;
+            cmdRenderCompileObj(&cmd, pch->obj, {out / "pch.hpp"}, {}, out / (compilerInfo(driver).clang ? "pch.hpp.pch" : "pch.hpp.gch"));
+            if (verbose) blog("Precompile header command: %s\n", cmd.c_str());
+            auto ret = runCmd(cmd);
+            if (ret != 0) panic("Failed to precompile header of %s\n", pch->target.c_str());
+        };
+        return LazyPath{.step = step};
+    }
+
+    // absolute path for header given explicitly, include spelling for automatically picked ones
+    std::vector<std::string> pchHeaders(Pch* pch) {
+        if (!pch->opts.automatic) return {"\"" + escapeStringJSON((root / pch->opts.header).string()) + "\""};
+
+        struct Candidate {
+            size_t count = 0;
+            size_t first_seen = 0;
+            bool inside_root = false;
+            bool outside_root = false;
+        };
+        std::unordered_map<std::string, Candidate> candidates;
+        for (const auto& src : pch->sources) {
+            auto path = root / src;
+            std::ifstream fin{path, std::ios::binary};
+            std::string text{std::istreambuf_iterator<char>{fin}, {}};
+            auto includes = topLevelSystemIncludes(text);
+            std::unordered_set<std::string> seen;
+            includes.erase(std::remove_if(includes.begin(), includes.end(), [&](const std::string& inc) { return !seen.insert(inc).second; }), includes.end());
+
+            // scan tells where header was found. it is the same scan obj of this source uses (pch is not part of it), so
+            // it runs once and picked headers are the same from the first build on
+            auto obj = pch->obj;
+            obj.source = path;
+            auto deps = parseDepfile(cacheEntryGetPath(depScan(obj, path)));
+
+            for (const auto& inc : includes) {
+                auto [it, added] = candidates.try_emplace(inc);
+                if (added) it->second.first_seen = candidates.size();
+                it->second.count++;
+                auto name = "/" + inc.substr(1, inc.size() - 2);
+                bool found = false;
+                for (const auto& dep : deps) {
+                    auto dep_str = dep.string();
+                    if (dep_str.size() < name.size() || dep_str.compare(dep_str.size() - name.size(), name.size(), name) != 0) continue;
+                    bool inside = isInsideDir(dep, root) && !isInsideDir(dep, cache);
+                    (inside ? it->second.inside_root : it->second.outside_root) = true;
+                    found = true;
+                }
+                if (!found) it->second.outside_root = true; // headers of compiler are not kept in depfiles, see depScan
+            }
+        }
+
+        size_t threshold = std::max<size_t>(2, (pch->sources.size() + 1) / 2);
+        std::vector<std::pair<std::string, Candidate>> picked;
+        for (const auto& [inc, candidate] : candidates) {
+            if (candidate.count < threshold || (candidate.inside_root && !candidate.outside_root)) continue;
+            picked.push_back({inc, candidate});
+        }
+        std::sort(picked.begin(), picked.end(), [](const auto& a, const auto& b) {
+            if (a.second.count != b.second.count) return a.second.count > b.second.count;
+            return a.second.first_seen < b.second.first_seen;
+        });
+        if (picked.size() > pch->opts.max_headers) picked.resize(pch->opts.max_headers);
+        std::sort(picked.begin(), picked.end(), [](const auto& a, const auto& b) { return a.second.first_seen < b.second.first_seen; });
+        std::vector<std::string> res;
+        for (const auto& [inc, candidate] : picked) res.push_back(inc);
+        return res;
+    }
+
+    // "#include <...>" lines outside of conditional blocks, as spelled
+    static std::vector<std::string> topLevelSystemIncludes(const std::string& text) {
+        std::vector<std::string> res;
+        int depth = 0;
+        std::istringstream in{text};
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t pos = line.find_first_not_of(" \t");
+            if (pos == std::string::npos || line[pos] != '#') continue;
+            pos = line.find_first_not_of(" \t", pos + 1);
+            if (pos == std::string::npos) continue;
+            auto directive = line.substr(pos, line.find_first_of(" \t<\"", pos) - pos);
+            if (directive == "if" || directive == "ifdef" || directive == "ifndef") depth++;
+            else if (directive == "endif") depth--;
+            else if (directive == "include" && depth == 0) {
+                auto open = line.find('<', pos);
+                auto close = line.find('>', pos);
+                if (open != std::string::npos && close != std::string::npos && open < close) res.push_back(line.substr(open, close - open + 1));
+            }
+        }
+        return res;
+    }
+
+    void writePchStub(Pch* pch) {
+        auto content = std::string{"// precompiled header stub generated by buildpp, do not edit\n"};
+        for (const auto& header : pchHeaders(pch)) content += "#include " + header + "\n";
+        std::ifstream fin{pch->obj.source, std::ios::binary};
+        if (std::string{std::istreambuf_iterator<char>{fin}, {}} == content) return;
+        std::error_code ec;
+        std::filesystem::create_directories(pch->obj.source.parent_path(), ec);
+        writeEntireFile(pch->obj.source, content);
+        runtime()->hash_cache.erase(pch->obj.source); // may be remembered by build server
+    }
+
+    CompilerInfo compilerInfo(const Path& driver) {
+        std::lock_guard<std::mutex> lock(compiler_infos_mutex);
+        if (auto it = compiler_infos.find(driver.string()); it != compiler_infos.end()) return it->second;
+        if (!compiler_records_loaded) loadCompilerRecords();
+        auto binary = resolveDriverBinary(driver);
+        if (auto it = compiler_records.find(driver.string()); it != compiler_records.end()) {
+            auto& stamps = it->second.stamps;
+            bool valid = !stamps.empty() && stamps[0].first == binary;
+            for (const auto& [path, mtime_ns] : stamps) valid = valid && mtimeNs(path) == mtime_ns;
+            if (valid) return compiler_infos[driver.string()] = it->second.info;
+        }
+
+        auto output = [](const std::string& cmd) {
+            std::string res;
+            if (auto* pipe = ::popen(cmd.c_str(), "r")) {
+                char buf[256];
+                while (std::fgets(buf, sizeof(buf), pipe)) res += buf;
+                ::pclose(pipe);
+            }
+            return res;
+        };
+        CompilerInfo info;
+        auto version = output(driver.string() + " --version 2>/dev/null");
+        info.clang = version.find("clang") != std::string::npos;
+        info.major = std::atoi(output(driver.string() + " -dumpversion 2>/dev/null").c_str());
+        if (info.clang) info.has_scan_deps = !output("command -v clang-scan-deps 2>/dev/null").empty();
+        for (const char* lang : {"c", "c++"}) {
+            auto search = output("echo | " + driver.string() + " -x" + lang + " -E -v - 2>&1 >/dev/null");
+            std::istringstream in{search};
+            std::string line;
+            bool inside = false;
+            while (std::getline(in, line)) {
+                if (line.rfind("#include <...> search starts here:", 0) == 0) inside = true;
+                else if (line.rfind("End of search list.", 0) == 0) inside = false;
+                else if (inside && !line.empty() && line[0] == ' ') {
+                    auto dir = Path{line.substr(1, line.find(" (framework directory)") - 1)}.lexically_normal();
+                    if (!dir.has_filename()) dir = dir.parent_path();
+                    if (std::find(info.system_include_dirs.begin(), info.system_include_dirs.end(), dir) == info.system_include_dirs.end()) {
+                        info.system_include_dirs.push_back(dir);
+                    }
+                }
+            }
+        }
+
+        CompilerRecord record;
+        record.stamps.push_back({binary, mtimeNs(binary)});
+        for (const auto& dir : info.system_include_dirs) record.stamps.push_back({dir, mtimeNs(dir)});
+        info.identity = hashString(version);
+        if (!binary.empty()) info.identity = info.identity.combine(hashFile(binary));
+        for (const auto& [path, mtime_ns] : record.stamps) info.identity = info.identity.combine(hashString(path.string())).combine(Hash{static_cast<uint64_t>(mtime_ns)});
+        record.info = info;
+        compiler_records[driver.string()] = record;
+        saveCompilerRecords();
+        return compiler_infos[driver.string()] = info;
+    }
+
+    static int64_t mtimeNs(const Path& path) {
+        struct stat st = {};
+        if (::stat(path.c_str(), &st) != 0) return -1;
+        return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    }
+
+    // real file behind driver name, found through PATH and symlinks. empty if there is none
+    static Path resolveDriverBinary(const Path& driver) {
+        std::error_code ec;
+        if (driver.has_parent_path()) return std::filesystem::canonical(driver, ec);
+        auto* path_env = std::getenv("PATH");
+        std::istringstream iss{path_env ? path_env : ""};
+        std::string dir;
+        while (std::getline(iss, dir, ':')) {
+            auto candidate = Path{dir} / driver;
+            if (::access(candidate.c_str(), X_OK) == 0) return std::filesystem::canonical(candidate, ec);
+        }
+        return {};
+    }
+
+    static bool isSystemHeader(const CompilerInfo& info, const Path& path) {
+        if (info.system_include_dirs.empty()) return false;
+        auto normal = path.lexically_normal().string();
+        for (const auto& dir : info.system_include_dirs) {
+            const auto& d = dir.string();
+            if (normal.size() > d.size() && normal[d.size()] == '/' && normal.compare(0, d.size(), d) == 0) return true;
+        }
+        return false;
+    }
+
+    void loadCompilerRecords() {
+        compiler_records_loaded = true;
+        std::ifstream fin{compilerRecordsPath(), std::ios::binary};
+        std::string data{std::istreambuf_iterator<char>{fin}, {}};
+        CacheReader r{data};
+        if (data.empty() || r.u64() != compiler_records_version) return;
+        auto count = r.u64();
+        for (uint64_t i = 0; i < count && r.ok; i++) {
+            auto driver = r.str();
+            CompilerRecord record;
+            record.info.clang = r.u64();
+            record.info.major = static_cast<int>(r.u64());
+            record.info.has_scan_deps = r.u64();
+            auto dirs = r.u64();
+            for (uint64_t j = 0; j < dirs && r.ok; j++) record.info.system_include_dirs.push_back(r.str());
+            record.info.identity = Hash{r.u64()};
+            auto stamps = r.u64();
+            for (uint64_t j = 0; j < stamps && r.ok; j++) {
+                auto path = r.str();
+                record.stamps.push_back({path, static_cast<int64_t>(r.u64())});
+            }
+            if (r.ok) compiler_records[driver] = std::move(record);
+        }
+    }
+
+    void saveCompilerRecords() {
+        CacheWriter w;
+        w.u64(compiler_records_version);
+        w.u64(compiler_records.size());
+        for (const auto& [driver, record] : compiler_records) {
+            w.str(driver);
+            w.u64(record.info.clang);
+            w.u64(static_cast<uint64_t>(record.info.major));
+            w.u64(record.info.has_scan_deps);
+            w.u64(record.info.system_include_dirs.size());
+            for (const auto& dir : record.info.system_include_dirs) w.str(dir.string());
+            w.u64(record.info.identity.value);
+            w.u64(record.stamps.size());
+            for (const auto& [path, mtime_ns] : record.stamps) {
+                w.str(path.string());
+                w.u64(static_cast<uint64_t>(mtime_ns));
+            }
+        }
+        auto tmp_path = newTmpPath();
+        std::ofstream fout{tmp_path, std::ios::binary};
+        fout.write(w.buf.data(), w.buf.size());
+        fout.close();
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, compilerRecordsPath(), ec);
+    }
+
+    void cmdRenderPch(std::string* cmd, const ObjOpts& obj) {
+        if (!obj.pch) return;
+        auto dir = resolveLazyPath(*obj.pch);
+        if (std::filesystem::exists(dir / "pch.hpp.pch")) *cmd += " -include-pch \"" + escapeStringJSON((dir / "pch.hpp.pch").string()) + "\"";
+        else *cmd += " -include \"" + escapeStringJSON((dir / "pch.hpp").string()) + "\""; // gcc picks pch.hpp.gch next to it
+    }
+
+    // scans sources of targets with modules enabled and orders their objs: module interface is built by its own step
+    // into cache, before objs that import it and before its own obj. interface is parsed only there: clang compiles
+    // its obj from the built .pcm, gcc writes the obj together with the .gcm and obj step takes it from there.
+    // dependencies are scanned while configuring, so build server and watch mode restart when they change (see modulesChanged)
+    void resolveModules() {
+        module_units.clear();
+        module_bmis.clear();
+        for (auto& obj : objs) {
+            if (!obj.opts.modules) continue;
+            auto unit = scanModuleUnit(obj.opts);
+            for (const auto& name : unit.provides) {
+                auto [it, added] = module_bmis.try_emplace(name, ModuleBmi{.provider = &obj});
+                if (!added) panic("Module %s is provided by both %s and %s\n", name.c_str(), it->second.provider->opts.source.c_str(), obj.opts.source.c_str());
+            }
+            module_units[&obj] = std::move(unit);
+        }
+
+        for (auto& [name, bmi] : module_bmis) {
+            auto* provider = bmi.provider;
+            bmi.step = addStep({.name = name + ".bmi", .desc = "Module interface " + name, .silent = true});
+            for (auto* dep : provider->step->deps) bmi.step->deps.push_back(dep); // generated headers, pch
+            for (auto in : provider->step->inputs) {
+                if (in.step) bmi.step->deps.push_back(in.step);
+            }
+            bmi.step->inputs_hash = [this, provider](Hash h) {
+                h = h.combine(hashString("bmi"));
+                h = h.combine(hashObjOpts(provider->opts));
+                return h.combine(buildEntireSourceFileHashCached(provider->opts, provider->opts.source));
+            };
+            bmi.step->action = [this, provider, name = name](Output out) {
+                std::error_code ec;
+                std::filesystem::create_directories(out, ec);
+                auto opts = provider->opts;
+                auto info = compilerInfo(applyFlagsOverlay(global_flags, &opts.flags).compile_driver);
+                auto bmi_path = out / bmiFileName(name, info);
+                opts.flags.extra_flags += moduleFlags(provider, bmi_path);
+                std::string cmd;
+                if (info.clang) {
+                    opts.flags.extra_flags += " --precompile";
+                    cmdRenderCompileObj(&cmd, opts, {opts.source}, {}, bmi_path);
+                } else {
+                    cmdRenderCompileObj(&cmd, opts, {opts.source}, {}, out / interfaceObjFileName);
+                    cmd += " -c";
+                }
+                if (verbose) blog("Module interface command: %s\n", cmd.c_str());
+                if (runCmd(cmd) != 0) panic("Failed to build interface of module %s\n", name.c_str());
+            };
+        }
+
+        for (auto& [obj, unit] : module_units) {
+            if (!unit.provides.empty()) obj->step->deps.push_back(module_bmis.at(unit.provides[0]).step); // obj is made from it
+            for (const auto& name : unit.imports) {
+                auto it = module_bmis.find(name);
+                if (it == module_bmis.end()) {
+                    panic("Module %s imported by %s is not provided by sources of targets with modules enabled (header units and std module are not supported)\n", name.c_str(), obj->opts.source.c_str());
+                }
+                obj->step->deps.push_back(it->second.step);
+                for (const auto& own : unit.provides) {
+                    if (own != name) module_bmis[own].step->deps.push_back(it->second.step); // interface imports other one
+                }
+            }
+        }
+    }
+
+    // whether scanned module dependencies differ from ones graph was configured with
+    bool modulesChanged() {
+        for (const auto& [obj, unit] : module_units) {
+            std::error_code ec;
+            if (!std::filesystem::exists(obj->opts.source, ec) || !(scanModuleUnit(obj->opts) == unit)) return true;
+        }
+        return false;
+    }
+
+    static constexpr const char* interfaceObjFileName = "interface.o"; // next to .gcm, built by the same gcc run
+
+    static std::string bmiFileName(std::string name, const CompilerInfo& info) {
+        std::replace(name.begin(), name.end(), ':', '-');
+        return name + (info.clang ? ".pcm" : ".gcm");
+    }
+
+    // P1689 scan of source, cached by scan command and source contents. done by clang-scan-deps for clang, by gcc 14+
+    // itself, and by reading preprocessed source for older gcc that can build modules but can't report them
+    ModuleUnit scanModuleUnit(const ObjOpts& obj) {
+        auto info = compilerInfo(applyFlagsOverlay(global_flags, &obj.flags).compile_driver);
+        std::string cmd;
+        cmdRenderCompileObj(&cmd, obj, {obj.source}, {}, "");
+        auto scan_h = hashString("p1689 " + cmd).combine(hashFile(obj.source));
+        if (!cacheEntryExists(scan_h)) {
+            auto out = newTmpPath();
+            if (info.clang && info.has_scan_deps) {
+                auto scan = "clang-scan-deps -format=p1689 -- " + cmd + " -c -o \"" + escapeStringJSON(out.string()) + ".o\" > \"" + escapeStringJSON(out.string()) + "\"";
+                if (runCmd(scan) != 0) panic("Failed to scan modules of %s\n    using cmd \"%s\"\n", obj.source.c_str(), scan.c_str());
+            } else if (!info.clang && info.major >= 14) {
+                auto scan = cmd + " -E -fmodules-ts -fdeps-format=p1689r5 -fdeps-file=\"" + escapeStringJSON(out.string()) + "\" -fdeps-target=obj.o -MD -MF /dev/null -o /dev/null";
+                if (runCmd(scan) != 0) panic("Failed to scan modules of %s\n    using cmd \"%s\"\n", obj.source.c_str(), scan.c_str());
+            } else {
+                auto preprocessed = newTmpPath();
+                auto scan = cmd + " -E -o \"" + escapeStringJSON(preprocessed.string()) + "\"";
+                if (runCmd(scan) != 0) panic("Failed to preprocess %s for module scan\n    using cmd \"%s\"\n", obj.source.c_str(), scan.c_str());
+                writeEntireFile(out, renderP1689(scanPreprocessedModuleUnit(readEntireFile(preprocessed))));
+                std::error_code ec;
+                std::filesystem::remove(preprocessed, ec);
+            }
+            cacheEntryMoveFromTmp(scan_h, out);
+        }
+
+        JsonValue json;
+        if (!parseJson(readEntireFile(cacheEntryGetPath(scan_h)), &json)) panic("Failed to parse module scan of %s\n", obj.source.c_str());
+        ModuleUnit unit;
+        const auto* rules = json.get("rules");
+        if (!rules || rules->array.empty()) return unit;
+        auto names = [](const JsonValue* list, std::vector<std::string>* res) {
+            if (!list) return;
+            for (const auto& item : list->array) {
+                if (const auto* name = item.get("logical-name")) res->push_back(name->string);
+            }
+        };
+        names(rules->array.front().get("provides"), &unit.provides);
+        names(rules->array.front().get("requires"), &unit.imports);
+        return unit;
+    }
+
+    // module declarations are at top level and whole on their line after preprocessing
+    static ModuleUnit scanPreprocessedModuleUnit(const std::string& text) {
+        ModuleUnit unit;
+        std::string module; // primary name of module this unit belongs to
+        std::istringstream in{text};
+        std::string line;
+        while (std::getline(in, line)) {
+            auto begin = line.find_first_not_of(" \t");
+            if (begin == std::string::npos || line[begin] == '#') continue;
+            auto end = line.find_last_not_of(" \t\r");
+            if (line[end] != ';') continue;
+            std::string_view decl{line.data() + begin, end - begin};
+            bool exported = decl.rfind("export ", 0) == 0;
+            if (exported) decl.remove_prefix(decl.find_first_not_of(' ', 7));
+            bool is_module = decl.rfind("module ", 0) == 0;
+            bool is_import = decl.rfind("import ", 0) == 0;
+            if (!is_module && !is_import) continue;
+            decl.remove_prefix(7);
+            auto name = std::string{decl.substr(decl.find_first_not_of(' '))};
+            name.erase(name.find_last_not_of(' ') + 1);
+            if (name.empty() || name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_.:<>\"/") != std::string::npos) continue;
+            if (is_module) {
+                if (name == ":private") continue;
+                module = name.substr(0, name.find(':'));
+                if (exported || name.find(':') != std::string::npos) unit.provides.push_back(name); // interface or partition
+                else unit.imports.push_back(name); // implementation unit imports its interface implicitly
+            } else {
+                unit.imports.push_back(name[0] == ':' ? module + name : name);
+            }
+        }
+        return unit;
+    }
+
+    static std::string renderP1689(const ModuleUnit& unit) {
+        auto list = [](const std::vector<std::string>& names) {
+            std::string res;
+            for (const auto& name : names) res += std::string{res.empty() ? "" : ","} + "{\"logical-name\":\"" + escapeStringJSON(name) + "\"}";
+            return res;
+        };
+        return "{\"version\":1,\"revision\":0,\"rules\":[{\"provides\":[" + list(unit.provides) + "],\"requires\":[" + list(unit.imports) + "]}]}\n";
+    }
+
+    // flags for compiling obj or interface of module it provides (own_bmi), with interfaces of all modules it imports.
+    // from_bmi is for clang compiling obj of interface from its .pcm instead of source
+    std::string moduleFlags(Obj* obj, Path own_bmi, bool from_bmi = false) {
+        auto it = module_units.find(obj);
+        if (it == module_units.end()) return "";
+        auto info = compilerInfo(applyFlagsOverlay(global_flags, &obj->opts.flags).compile_driver);
+
+        std::vector<std::string> imports; // transitively, compilers need interfaces of imports of imports too
+        std::vector<std::string> queue = it->second.imports;
+        while (!queue.empty()) {
+            auto name = queue.back();
+            queue.pop_back();
+            if (std::find(imports.begin(), imports.end(), name) != imports.end()) continue;
+            imports.push_back(name);
+            for (const auto& next : module_units[module_bmis.at(name).provider].imports) queue.push_back(next);
+        }
+        auto bmiPath = [&](const std::string& name) { return resolveLazyPath({.step = module_bmis.at(name).step}) / bmiFileName(name, info); };
+
+        std::string flags;
+        if (info.clang) {
+            for (const auto& name : imports) flags += " -fmodule-file=" + name + "=\"" + escapeStringJSON(bmiPath(name).string()) + "\"";
+            if (!it->second.provides.empty() && !from_bmi) flags += " -x c++-module";
+            return flags;
+        }
+        std::string mapper;
+        for (const auto& name : imports) mapper += name + " " + bmiPath(name).string() + "\n";
+        for (const auto& name : it->second.provides) mapper += name + " " + own_bmi.string() + "\n";
+        auto mapper_path = newTmpPath();
+        writeEntireFile(mapper_path, mapper);
+        return " -fmodules-ts -fmodule-mapper=\"" + escapeStringJSON(mapper_path.string()) + "\"";
+    }
+
+    std::vector<Obj*> addGeneratedObjs(ObjOpts obj_opts, const std::vector<LazyPath>& generated_sources) {
+        std::vector<Obj*> result;
+        obj_opts.modules = false; // generated sources do not exist while modules are resolved
+        for (const auto& gen : generated_sources) {
+            auto opts = obj_opts;
+            opts.generated_source = gen;
+            result.push_back(addObj(opts, true));
+        }
+        return result;
+    }
+
+    // target is name of link step (libfoo.a of lib foo), so exe and lib of the same name don't share unity batches
+    std::vector<Obj*> addTargetObjs(const std::string& target,const UnityOpts& unity, ObjOpts obj_opts, const std::vector<Path>& sources) {
+        std::vector<Obj*> res;
+        if (obj_opts.modules) graph_snapshotable = false; // module dependencies are scanned while configuring
+        if (unity.enabled && !obj_opts.modules && !sources.empty()) return addUnityObjs(target, unity, obj_opts, sources); // module units can't be merged
+        for (const auto& src : sources) {
+            obj_opts.source = src;
+            res.push_back(addObj(obj_opts, true));
+        }
+        return res;
+    }
+
+    struct UnitySource {
+        Path source;
+        uint64_t batch = 0; // source returns to it after leaving working set
+        uint64_t hash = 0;
+        uint64_t unchanged_runs = 0;
+        bool in_working_set = false;
+    };
+    static constexpr uint64_t unity_state_version = 1;
+
+    std::vector<Obj*> addUnityObjs(const std::string& target, const UnityOpts& unity, ObjOpts obj_opts, const std::vector<Path>& sources) {
+        graph_snapshotable = false;
+        auto dir = cache / "unity" / target;
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec) panic("Failed to create unity directory %s: %s\n", dir.c_str(), ec.message().c_str());
+        auto state_path = cache / "unity" / (target + ".state");
+
+        std::vector<UnitySource> prev;
+        uint64_t prev_batches = 0;
+        {
+            std::ifstream fin{state_path, std::ios::binary};
+            std::string data{std::istreambuf_iterator<char>{fin}, {}};
+            CacheReader r{data};
+            if (!data.empty() && r.u64() == unity_state_version) {
+                prev_batches = r.u64();
+                auto count = r.u64();
+                for (uint64_t i = 0; i < count && r.ok; i++) {
+                    UnitySource src;
+                    src.source = r.str();
+                    src.batch = r.u64();
+                    src.hash = r.u64();
+                    src.unchanged_runs = r.u64();
+                    src.in_working_set = r.u64() != 0;
+                    if (src.batch >= prev_batches) r.ok = false;
+                    prev.push_back(src);
+                }
+                if (!r.ok) prev_batches = 0;
+            }
+        }
+
+        uint64_t batches_count = (sources.size() + std::max<size_t>(unity.batch_size, 1) - 1) / std::max<size_t>(unity.batch_size, 1);
+        std::vector<UnitySource> state;
+        if (prev_batches != batches_count) {
+            // plan from scratch, most expensive sources first, each into currently cheapest batch
+            bool all_timed = true;
+            for (const auto& src : sources) {
+                auto it = step_history.find(Path{src}.replace_extension("o").string());
+                if (it == step_history.end() || it->second.duration_ms == 0) all_timed = false;
+            }
+            std::vector<uint64_t> costs;
+            for (const auto& src : sources) {
+                if (all_timed) costs.push_back(step_history[Path{src}.replace_extension("o").string()].duration_ms);
+                else costs.push_back(std::filesystem::file_size(root / src, ec));
+            }
+            std::vector<size_t> order(sources.size());
+            for (size_t i = 0; i < order.size(); i++) order[i] = i;
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return costs[a] > costs[b]; });
+            std::vector<uint64_t> batch_costs(batches_count, 0);
+            state.resize(sources.size());
+            for (auto i : order) {
+                uint64_t batch = std::min_element(batch_costs.begin(), batch_costs.end()) - batch_costs.begin();
+                batch_costs[batch] += costs[i];
+                state[i] = UnitySource{.source = sources[i], .batch = batch, .hash = hashFile(root / sources[i]).value};
+            }
+        } else {
+            std::unordered_map<std::string, UnitySource> known;
+            for (const auto& src : prev) known[src.source.string()] = src;
+            std::vector<uint64_t> batch_sizes(batches_count, 0);
+            for (const auto& src : sources) {
+                if (auto it = known.find(src.string()); it != known.end()) batch_sizes[it->second.batch]++;
+            }
+            for (const auto& src : sources) {
+                auto hash = hashFile(root / src).value;
+                auto it = known.find(src.string());
+                if (it == known.end()) { // new source is compiled alone at first, so that batches are not reshuffled
+                    uint64_t batch = std::min_element(batch_sizes.begin(), batch_sizes.end()) - batch_sizes.begin();
+                    batch_sizes[batch]++;
+                    state.push_back({.source = src, .batch = batch, .hash = hash, .in_working_set = true});
+                    continue;
+                }
+                auto entry = it->second;
+                if (entry.hash != hash) {
+                    entry.hash = hash;
+                    entry.unchanged_runs = 0;
+                    entry.in_working_set = true;
+                } else if (entry.in_working_set && ++entry.unchanged_runs >= unity.working_set_runs) {
+                    entry.in_working_set = false;
+                }
+                state.push_back(entry);
+            }
+        }
+
+        CacheWriter w;
+        w.u64(unity_state_version);
+        w.u64(batches_count);
+        w.u64(state.size());
+        for (const auto& src : state) {
+            w.str(src.source.string());
+            w.u64(src.batch);
+            w.u64(src.hash);
+            w.u64(src.unchanged_runs);
+            w.u64(src.in_working_set);
+        }
+        auto tmp_path = newTmpPath();
+        writeEntireFile(tmp_path, w.buf);
+        std::filesystem::rename(tmp_path, state_path, ec);
+
+        std::vector<Obj*> res;
+        std::vector<std::vector<Path>> batches(batches_count);
+        for (const auto& src : state) {
+            if (src.in_working_set) {
+                obj_opts.source = src.source;
+                res.push_back(addObj(obj_opts, true));
+            } else {
+                batches[src.batch].push_back(root / src.source);
+            }
+        }
+        for (size_t i = 0; i < batches.size(); i++) {
+            if (batches[i].empty()) continue;
+            auto content = std::string{"// unity source generated by buildpp, do not edit\n"};
+            for (const auto& src : batches[i]) content += "#include \"" + escapeStringJSON(src.string()) + "\"\n";
+            auto batch_path = dir / ("batch-" + std::to_string(i) + ".cpp");
+            std::ifstream fin{batch_path, std::ios::binary};
+            if (std::string{std::istreambuf_iterator<char>{fin}, {}} != content) writeEntireFile(batch_path, content);
+
+            obj_opts.source = batch_path;
+            auto* obj = addObj(obj_opts, true);
+            obj->step->opts.name = target + "-unity-" + std::to_string(i) + ".o";
+            obj->step->opts.desc = "Unity object of " + std::to_string(batches[i].size()) + " sources of " + target;
+            obj->unity_sources = batches[i];
+            res.push_back(obj);
+        }
+        return res;
+    }
+
     // adds file, wrapped as step. to be used later in some step inputs
     LazyPath addFile(Path src) {
-        if (build_phase_started) panic("Cannot add new file \"%s\" after build phase has started\n", src.c_str());
+        if (!graphEditable()) panic("Cannot add new file \"%s\" after build phase has started\n", src.c_str());
+        GraphCallGuard call{this, GraphCall::File};
+        if (call.w) snap(call.w, src);
         auto file_step = addStep({.name = "file-" + src.string(), .desc = "File " + src.string(), .silent = true});
         src = root / src; // canonicalize after nice name generation
-        file_step->inputs_hash = [this, src](Hash) { return hashFile(src); };
+        file_step->inputs_hash = [this, src](Hash) {
+            auto h = hashFile(src);
+            explainKeyItem("file", src.string(), h);
+            return h;
+        };
         file_step->action = [this, src](Output out) {
             std::error_code ec;
             std::filesystem::copy_file(src, out, std::filesystem::copy_options::overwrite_existing, ec);
@@ -766,36 +2779,77 @@ public:
 
     // step must compile one object file from source
     Obj* addObj(ObjOpts opts, bool silent = false) {
-        if (build_phase_started) panic("Cannot add new object file \"%s\" after build phase has started\n", opts.source.c_str());
+        if (!graphEditable()) panic("Cannot add new object file \"%s\" after build phase has started\n", opts.source.c_str());
+        GraphCallGuard call{this, GraphCall::Obj};
+        if (call.w) {
+            snap(call.w, opts);
+            snap(call.w, silent);
+        }
+        if (opts.generated_source && opts.modules) panic("Generated source %s can not be a module unit\n", lazyPathKey(*opts.generated_source).c_str());
+        auto source_name = Path{opts.generated_source ? lazyPathKey(*opts.generated_source) : opts.source.string()};
         auto step = addStep({
-            .name = Path{opts.source}.replace_extension("o").string(),
-            .desc = "Object file for " + Path{opts.source}.filename().string(),
+            .name = Path{source_name}.replace_extension("o").string(),
+            .desc = "Object file for " + source_name.filename().string(),
             .silent = silent
         });
-        opts.source = root / opts.source; // make source absolute for cases when build script is run from other dir
+        if (!opts.generated_source) opts.source = root / opts.source; // make source absolute for cases when build script is run from other dir
         build_all_step->deps.push_back(step);
 
         objs.push_back({opts, step});
         auto obj = &objs.back();
+        if (opts.pch && opts.pch->step) step->deps.push_back(opts.pch->step);
+        if (opts.generated_source) step->inputs.push_back(*opts.generated_source);
 
         step->inputs_hash = [this, obj](Hash h) {
             auto inputs = completedInputs(obj->step);
-            h = h.combine(hashString(obj->opts.source.string()));
-            h = h.combine(hashFile(obj->opts.source));
+            if (obj->opts.generated_source) obj->opts.source = resolveLazyPath(*obj->opts.generated_source);
+            h = h.combine(hashString(objSourceKey(obj->opts)));
+            h = h.combine(sourceHash(obj->opts.source));
+            explainKeyItem("file", objSourceKey(obj->opts), sourceHash(obj->opts.source));
             h = h.combine(hashObjOpts(obj->opts));
             Hash src_h = buildEntireSourceFileHashCached(obj->opts, obj->opts.source);
             h = h.combine(src_h);
+            // pch and module objs depend on more than their preprocessed source
+            if (preprocessed_obj_keys && !obj->opts.pch && !obj->opts.modules) h = preprocessedObjKey(obj->opts, h);
+            // objs built with trace are kept apart from ones built without, so every cached one has its trace
+            if (time_trace && compilerInfo(applyFlagsOverlay(global_flags, &obj->opts.flags).compile_driver).clang) {
+                h = h.combine(hashString("time trace"));
+                explainKeyItem("flag", "time trace", {});
+            }
             return h;
         };
         step->action = [this, obj](Output out) mutable { // action is invoked when step must be performed
             std::string cmd;
             auto flags = obj->opts.flags;
-            cmdRenderCompileObj(&cmd, obj->opts, {obj->opts.source}, {}, out); // inputs 
+            auto opts = obj->opts;
+            auto info = compilerInfo(applyFlagsOverlay(global_flags, &opts.flags).compile_driver);
+            auto unit = module_units.find(obj);
+            if (unit != module_units.end() && !unit->second.provides.empty()) {
+                // interface unit, its interface step already parsed it
+                auto& name = unit->second.provides[0];
+                auto bmi_dir = resolveLazyPath({.step = module_bmis.at(name).step});
+                if (!info.clang) {
+                    std::error_code ec;
+                    std::filesystem::copy_file(bmi_dir / interfaceObjFileName, out, ec);
+                    if (ec) panic("Failed to copy obj of module interface %s: %s\n", name.c_str(), ec.message().c_str());
+                    return;
+                }
+                opts.flags.extra_flags += moduleFlags(obj, {}, true);
+                opts.source = bmi_dir / bmiFileName(name, info);
+            } else if (opts.modules) {
+                opts.flags.extra_flags += moduleFlags(obj, {});
+            }
+            cmdRenderCompileObj(&cmd, opts, {opts.source}, {}, out); // inputs 
+            if (opts.source == obj->opts.source) cmdRenderPch(&cmd, opts); // interfaces are built without pch
             cmd += " -c";
+            bool trace = time_trace && info.clang;
+            auto trace_path = Path{out}.replace_extension(".json"); // where clang before 16 puts it
+            if (trace) cmd += info.major >= 16 ? " -ftime-trace=" + trace_path.string() : std::string{" -ftime-trace"};
             if (verbose) blog("Compile Obj command: %s\n", cmd.data());
 
-            auto ret = std::system(cmd.data());
+            auto ret = runCmd(cmd);
             if (ret != 0) panic("Failed to build target: %s\n", obj->step->opts.name.c_str());
+            if (trace && std::filesystem::exists(trace_path)) cacheEntryMoveFromTmp(timeTraceKey(*obj->step->hash), trace_path);
         };
 
         return obj;
@@ -808,7 +2862,12 @@ public:
     }
 
     Step* addRunExe(Exe* exe, RunOptions opts) {
-        if (build_phase_started) panic("Cannot add new run step \"%s\" after build phase has started\n", opts.name.c_str());
+        if (!graphEditable()) panic("Cannot add new run step \"%s\" after build phase has started\n", opts.name.c_str());
+        GraphCallGuard call{this, GraphCall::RunExe};
+        if (call.w) {
+            snap(call.w, stepId(exe->link_step));
+            snap(call.w, opts);
+        }
         auto run = addStep({.name = opts.name, .desc = opts.desc, .phony = true, .silent = false});
         runs.push_back({opts, run});
         run->inputs.push_back({.step = exe->link_step});
@@ -827,7 +2886,7 @@ public:
                 cmd += arg + " ";
             }
             cmd += "&& popd > /dev/null";
-            auto ret = std::system(cmd.data());
+            auto ret = runCmd(cmd, true);
             if (ret != 0) panic("Failed to run exe: %s\n", exe->opts.name.c_str());
         };
         return run;
@@ -847,6 +2906,11 @@ public:
     };
 
     void installHeaders(std::vector<Path> headers, InstallHeaderOpts opts) {
+        GraphCallGuard call{this, GraphCall::InstallHeaders}; // copies right away, so it is replayed as well
+        if (call.w) {
+            snap(call.w, headers);
+            snap(call.w, opts);
+        }
         for (auto h : headers) {
             using co = std::filesystem::copy_options;
             auto to = out / "include" / opts.prefix / ((opts.as_tree) ? h : h.filename());
@@ -856,7 +2920,12 @@ public:
     }
 
     Step* install(Step* step, Path dst) {
-        if (build_phase_started) panic("Cannot add new install step \"%s\" after build phase has started\n", step->opts.name.c_str());
+        if (!graphEditable()) panic("Cannot add new install step \"%s\" after build phase has started\n", step->opts.name.c_str());
+        GraphCallGuard call{this, GraphCall::Install};
+        if (call.w) {
+            snap(call.w, stepId(step));
+            snap(call.w, dst);
+        }
         auto istep = addStep({.name = "install-" + step->opts.name, .desc = "Installs " + step->opts.name, .silent = true});
         dst = out / dst;
         istep->inputs.push_back({.step = step});
@@ -871,23 +2940,129 @@ public:
         return istep;
     }
 
+    // outputs of every input are cached separately, so only inputs that changed are given to the tool again, in chunks
+    // of opts.chunk_size per process. step itself holds all outputs, see Step::output
+    Step* addBatchCommand(BatchCommandOpts opts) {
+        if (!graphEditable()) panic("Cannot add new batch command \"%s\" after build phase has started\n", opts.name.c_str());
+        GraphCallGuard call{this, GraphCall::BatchCommand};
+        if (call.w) snap(call.w, opts);
+        if (opts.chunk_size == 0) panic("Batch command %s has zero chunk size\n", opts.name.c_str());
+        auto step = addStep({.name = opts.name, .desc = opts.desc});
+        batch_commands.push_back({.opts = opts, .step = step});
+        auto batch = &batch_commands.back();
+        for (const auto& in : opts.inputs) {
+            if (in.path.empty()) panic("Input of batch command %s must name a file, got whole output of step %s\n", opts.name.c_str(), in.step->opts.name.c_str());
+            step->inputs.push_back(in);
+            for (const auto& pattern : opts.outputs) {
+                auto name = batchOutputName(pattern, in.path);
+                if (step->declaresOutput(name)) panic("Batch command %s has output %s for more than one input\n", opts.name.c_str(), name.c_str());
+                step->opts.outputs.push_back(name);
+            }
+        }
+
+        step->inputs_hash = [this, batch](Hash h) {
+            auto base = hashString(batch->opts.cmd);
+            for (const auto& pattern : batch->opts.outputs) base = base.combine(hashString(pattern));
+            batch->keys.clear();
+            for (const auto& in : batch->opts.inputs) {
+                auto content_h = hashFile(resolveLazyPath(in));
+                explainKeyItem("file", lazyPathKey(in), content_h);
+                batch->keys.push_back(base.combine(hashString(lazyPathKey(in))).combine(content_h));
+                h = h.combine(batch->keys.back());
+            }
+            return h;
+        };
+        step->action = [this, batch](Output out) {
+            const auto& opts = batch->opts;
+            std::vector<size_t> missing;
+            for (size_t i = 0; i < opts.inputs.size(); i++) {
+                if (!cacheEntryExists(batch->keys[i])) missing.push_back(i);
+            }
+            for (size_t begin = 0; begin < missing.size(); begin += opts.chunk_size) {
+                auto end = std::min(missing.size(), begin + opts.chunk_size);
+                auto chunk_dir = newTmpPath();
+                std::filesystem::create_directories(chunk_dir);
+                std::vector<Path> chunk_inputs;
+                for (auto i = begin; i < end; i++) chunk_inputs.push_back(resolveLazyPath(opts.inputs[missing[i]]));
+                auto cmd = opts.cmd;
+                commandReplacePatternIfExist(&cmd, "{in}", chunk_inputs);
+                auto quoted_out = "\"" + escapeStringBash(chunk_dir.string()) + "\""; // no leading space, may follow --flag=
+                for (auto pos = cmd.find("{out}"); pos != std::string::npos; pos = cmd.find("{out}", pos + quoted_out.size())) {
+                    cmd.replace(pos, 5, quoted_out);
+                }
+                if (verbose) blog("Batch command %s on %zu inputs: %s\n", opts.name.c_str(), chunk_inputs.size(), cmd.c_str());
+                auto ret = runCmd(cmd);
+                if (ret != 0) panic("Batch command %s failed with code %d\n", opts.name.c_str(), ret);
+
+                for (auto i = begin; i < end; i++) {
+                    auto idx = missing[i];
+                    auto entry = newTmpPath();
+                    for (const auto& pattern : opts.outputs) {
+                        auto name = batchOutputName(pattern, opts.inputs[idx].path);
+                        if (!std::filesystem::exists(chunk_dir / name)) panic("Batch command %s did not produce %s for %s\n", opts.name.c_str(), name.c_str(), chunk_inputs[i - begin].c_str());
+                        std::filesystem::create_directories((entry / name).parent_path());
+                        std::filesystem::rename(chunk_dir / name, entry / name);
+                    }
+                    std::filesystem::create_directories(entry);
+                    cacheEntryMoveFromTmp(batch->keys[idx], entry);
+                }
+                std::filesystem::remove_all(chunk_dir);
+            }
+
+            // artifact of step links outputs of every input from their own cache entries
+            std::filesystem::create_directories(out);
+            for (size_t i = 0; i < opts.inputs.size(); i++) {
+                for (const auto& pattern : opts.outputs) {
+                    auto name = batchOutputName(pattern, opts.inputs[i].path);
+                    std::error_code ec;
+                    std::filesystem::create_directories((out / name).parent_path(), ec);
+                    std::filesystem::create_hard_link(cacheEntryGetPath(batch->keys[i]) / name, out / name, ec);
+                    if (ec) std::filesystem::copy_file(cacheEntryGetPath(batch->keys[i]) / name, out / name, ec);
+                    if (ec) panic("Failed to collect output %s of batch command %s: %s\n", name.c_str(), opts.name.c_str(), ec.message().c_str());
+                }
+            }
+        };
+        return step;
+    }
+
+    // limits how many steps of the pool run at once (depth <= 0 means no limit). steps of pool that does not take job
+    // slot run in addition to max_parallel_jobs, that is for waiting on network or disk. builtin pools are "link" (2) and
+    // "io" (unbounded, no job slot), redeclaring them changes their limits
+    void addPool(std::string name, int depth, bool takes_job_slot = true) {
+        if (build_phase_started) panic("Cannot add new pool \"%s\" after build phase has started\n", name.c_str());
+        pools[name] = Pool{.depth = depth, .takes_job_slot = takes_job_slot};
+    }
+
+    bool graphEditable() {
+        return !build_phase_started || dyndep_thread == std::this_thread::get_id();
+    }
+
     Step* addStep(Step::Options opts) {
-        if (build_phase_started) panic("Cannot add new step \"%s\" after build phase has started\n", opts.name.c_str());
+        if (!graphEditable()) panic("Cannot add new step \"%s\" after build phase has started\n", opts.name.c_str());
+        if (graph_call_depth == 0) graph_snapshotable = false; // step made by script itself, with its own closures
         steps.emplace_back();
         steps.back().opts = opts;
+        step_ids[&steps.back()] = step_order.size();
+        step_order.push_back(&steps.back());
         return &steps.back();
     }
 
     // requires system to have curl+tar
     Step* fetchByUrl(std::string name, Url url, Hash expected_hash) {
-        if (build_phase_started) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
-        auto step = addStep({.name = name, .desc = "", .silent = false});
+        if (!graphEditable()) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
+        GraphCallGuard call{this, GraphCall::Fetch};
+        if (call.w) {
+            snap(call.w, name);
+            snap(call.w, url);
+            snap(call.w, expected_hash);
+        }
+        auto step = addStep({.name = name, .desc = "", .silent = false, .pool = "io"});
         step->inputs_hash = [this, url, expected_hash](Hash) { return expected_hash; };
         step->action = [=](Output out) {
             // download tarball from url to tmp path
             std::string cmd = "curl --silent -L \"" + url.value + "\" -o \"" + out.string() + "\"";
             if (verbose) blog("Fetching using cmd: %s\n", cmd.c_str());
-            int res = std::system(cmd.c_str());
+            int res = runCmd(cmd);
             if (res != 0) panic("Failed to download tarball %s from %s\n", name.c_str(), url.value.c_str());
 
             // verify hash of unpacked tarball
@@ -904,8 +3079,13 @@ public:
     }
 
     Step* unpackTar(std::string name, Step* tarball_step) {
-        if (build_phase_started) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
-        auto unpack_step = addStep({.name = name, .desc = "Unpack tarball " + tarball_step->opts.name, .silent = false});
+        if (!graphEditable()) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
+        GraphCallGuard call{this, GraphCall::Unpack};
+        if (call.w) {
+            snap(call.w, name);
+            snap(call.w, stepId(tarball_step));
+        }
+        auto unpack_step = addStep({.name = name, .desc = "Unpack tarball " + tarball_step->opts.name, .silent = false, .pool = "io"});
         unpack_step->inputs.push_back({.step = tarball_step});
         unpack_step->inputs_hash = inputsHasher({
             .stable_id = "unpack-tar-" + tarball_step->opts.name,
@@ -915,14 +3095,20 @@ public:
             auto tarball_path = completedInputs(unpack_step).at(0);
             std::string cmd = "tar -xf \"" + tarball_path.string() + "\" -C \"" + out.string() + "\" --strip-components=1";
             if (verbose) blog("Unpacking tar cmd: %s\n", cmd.c_str());
-            int res = std::system(cmd.c_str());
+            int res = runCmd(cmd);
             if (res != 0) panic("Failed to unpack tarball in step %s\n", tarball_step->opts.name.c_str());
         };
         return unpack_step;
     }
 
     Step* runCMake(Step* sources, std::string build_target, std::vector<std::string> cmake_args = {}) {
-        if (build_phase_started) panic("Cannot add new step \"%s\" after build phase has started\n", sources->opts.name.c_str());
+        if (!graphEditable()) panic("Cannot add new step \"%s\" after build phase has started\n", sources->opts.name.c_str());
+        GraphCallGuard call{this, GraphCall::CMake};
+        if (call.w) {
+            snap(call.w, stepId(sources));
+            snap(call.w, build_target);
+            snap(call.w, cmake_args);
+        }
         auto step = addStep({.name = sources->opts.name + "-cmake", .desc = "CMake run over " + sources->opts.name, .silent = false});
         step->inputs.push_back({.step = sources});
         step->inputs_hash = inputsHasher({.stable_id = "cmake-" + sources->opts.name, .strings = cmake_args});
@@ -937,17 +3123,17 @@ public:
             cmd = "cmake -S \"" + src_dir.string() + "\" -B \"" + build_dir.string() + "\"";
             for (auto arg : cmake_args) cmd += " \"" + arg + "\" ";
             if (verbose) blog("CMake configure cmd: %s\n", cmd.c_str());
-            res = std::system(cmd.c_str());
+            res = runCmd(cmd);
             if (res != 0) panic("Failed to configure CMake project %s\n", sources->opts.name.c_str());
 
-            cmd = "cmake --build \"" + build_dir.string() + "\" --target " + build_target + " -j" + std::to_string(max_parallel_jobs);
+            cmd = "cmake --build \"" + build_dir.string() + "\" --target " + build_target + cmakeParallelFlag();
             if (verbose) blog("CMake build cmd: %s\n", cmd.c_str());
-            res = std::system(cmd.c_str());
+            res = runCmd(cmd);
             if (res != 0) panic("Failed to build CMake project %s\n", sources->opts.name.c_str());
 
             cmd = "cmake --install \"" + build_dir.string() + "\" --prefix \"" + out.string() + "\"";
             if (verbose) blog("CMake install cmd: %s\n", cmd.c_str());
-            res = std::system(cmd.c_str());
+            res = runCmd(cmd);
             if (res != 0) panic("Failed to install CMake project %s\n", sources->opts.name.c_str());
         };
 
@@ -955,7 +3141,14 @@ public:
     }
 
     Step* cmakeFromTarballUrl(std::string name, Url url, Hash expected_hash, std::vector<std::string> cmake_args = {}) {
-        if (build_phase_started) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
+        if (!graphEditable()) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
+        GraphCallGuard call{this, GraphCall::CMakeTarball};
+        if (call.w) {
+            snap(call.w, name);
+            snap(call.w, url);
+            snap(call.w, expected_hash);
+            snap(call.w, cmake_args);
+        }
         auto fetch_step = fetchByUrl(name + "-fetch", url, expected_hash);
         auto cmake_step = addStep({.name = name + "-cmake", .desc = "CMake configure-build " + name, .silent = false});
         cmake_step->inputs.push_back({.step = fetch_step});
@@ -972,13 +3165,13 @@ public:
                 cmd += " " + arg;
             }
             if (verbose) blog("CMake configure cmd: %s\n", cmd.c_str());
-            int res = std::system(cmd.c_str());
+            int res = runCmd(cmd);
             if (res != 0) panic("Failed to configure CMake project %s\n", name.c_str());
 
             // now build it
-            cmd = "cmake --build \"" + tmp_build_dir.string() + "\" --target install -j" + std::to_string(max_parallel_jobs);
+            cmd = "cmake --build \"" + tmp_build_dir.string() + "\" --target install" + cmakeParallelFlag();
             if (verbose) blog("CMake build cmd: %s\n", cmd.c_str());
-            res = std::system(cmd.c_str());
+            res = runCmd(cmd);
             if (res != 0) panic("Failed to build CMake project %s\n", name.c_str());
         };
         return cmake_step;
@@ -986,42 +3179,25 @@ public:
 
     // will compile build.cpp of subproject and return Build object to operate on it
     SubProj* addSubproject(std::string name, Dir d) {
-        if (build_phase_started) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
+        if (!graphEditable()) panic("Cannot add new step \"%s\" after build phase has started\n", name.c_str());
+        graph_snapshotable = false; // subproject graph lives in its own plugin
         d = root / d;
         auto src = d / "build.cpp";
         if (!std::filesystem::exists(src)) panic("Subproject directory %s does not contain build.cpp\n", d.c_str());
 
         // first, compile and cache buildpp binary for subproject
-        auto sub_buildpp_path = cache / "tmp" / ("buildpp-subproj-" + name);
         auto hash = buildEntireSourceFileHashCached({.flags = {.compile_driver = BPP_RECOMPILE_SELF_CMD}}, src);
-        if (!cacheEntryExists(hash)) {
-            blog("Compiling build script for subproject %s\n", name.c_str());
-            // build shared library for buildpp
-            std::string cmd;
-            cmd += BPP_RECOMPILE_SELF_CMD;
-            cmd += " -shared -fPIC";
-            cmd += " -o \"" + sub_buildpp_path.string() + "\"";
-            cmd += " \"" + src.string() + "\"";
-            if (verbose) blog("Subproject buildpp compile cmd: %s\n", cmd.c_str());
-            int res = std::system(cmd.c_str());
-            if (res != 0) panic("Failed to compile buildpp for subproject %s\n", name.c_str());
-            cacheEntryMoveFromTmp(hash, sub_buildpp_path);
-        }
+        auto lib = compileBuildScriptPlugin(hash, src, "subproject " + name);
 
-        auto lib = cacheEntryGetPath(hash);
         sub_builds.push_back({.opts = {.name = name, .dir = d}});
         auto subproj = &sub_builds.back();
         subproj->b = std::make_unique<Build>(saved_argc, saved_argv.data(), d, cache.c_str(), (out / name).c_str(), global_flags);
 
-        // load library, let it live forever
-        subproj->configure_handle = dlopen(lib.c_str(), RTLD_LAZY | RTLD_LOCAL);
-        if (!subproj->configure_handle) panic("Failed to dlopen buildpp subproject library %s: %s\n", lib.c_str(), dlerror());
-        using ConfF = void (*)(Build*);
-        auto configure_fn = (ConfF)dlsym(subproj->configure_handle, "configure_stable");
-        if (!configure_fn) panic("Failed to find symbol \"configure_stable\" in subproject library %s: %s\n", lib.c_str(), dlerror());
+        auto configure_fn = loadConfigureStable(lib, &subproj->configure_handle);
         subproj->b->preConfigure();
         configure_fn(subproj->b.get());
         subproj->b->dump_compile_commands = false; // force-disable compile commands dump for subprojects
+        subproj->b->snapshot_graph = false; // it shares cache dir with us
         subproj->b->postConfigure();
         subproj->b->build_phase_started = true; // prevent further configuration
         for (auto cce : subproj->b->compile_commands_list) compile_commands_list.push_back(cce); // just copy them
@@ -1048,11 +3224,75 @@ public:
     void runBuild() {
         if (build_phase_started) panic("Build phase already started. Do NOT call runBuildPhase() multiple times\n");
         build_phase_started = true;
+        if (server_mode) {
+            serve();
+            return;
+        }
         if (report_help) {
             reportHelp();
             return;
         }
+        if (watch_mode) {
+            watch();
+            return;
+        }
+        performRequestedSteps();
+    }
+
+    // connects to build server of this project, if one is running, and lets it do the work.
+    // returns exit code of the request, or nothing if build must be done by this process
+    static std::optional<int> forwardToServer(int argc, char** argv, Path env_root, const char* env_cache) {
+        for (int i = 1; i < argc; i++) {
+            if (std::string_view{argv[i]} == "--") break;
+            if (std::string_view{argv[i]} == "--server" || std::string_view{argv[i]} == "--no-server" || std::string_view{argv[i]} == "--watch") return std::nullopt;
+        }
+        std::error_code ec;
+        auto root_dir = env_root.empty() ? std::filesystem::current_path() : env_root;
+        auto socket_path = serverSocketPath(std::filesystem::weakly_canonical(root_dir / (env_cache ? env_cache : ".cache"), ec));
+        if (!std::filesystem::exists(socket_path, ec)) return std::nullopt;
+
+        CacheWriter request;
+        request.str(std::filesystem::current_path().string());
+        request.u64(argc);
+        for (int i = 0; i < argc; i++) request.str(argv[i]);
+
+        // server may restart itself to pick up build script changes, then request is repeated
+        for (int attempt = 0; attempt < 3; attempt++) {
+            int fd = connectToServer(socket_path);
+            if (fd < 0) return std::nullopt;
+
+            // our stdio goes along with request header, so server writes right into our terminal
+            uint64_t size = request.buf.size();
+            int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+            char control[CMSG_SPACE(sizeof(fds))] = {};
+            iovec iov{.iov_base = &size, .iov_len = sizeof(size)};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            auto* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+            std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+            int32_t status = 0;
+            bool ok = ::sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(size)
+                && sendAll(fd, request.buf.data(), request.buf.size())
+                && recvAll(fd, &status, sizeof(status));
+            ::close(fd);
+            if (!ok) return std::nullopt; // server died, it is safe to build on our own
+            if (status == server_status_build_locally) return std::nullopt;
+            if (status != server_status_retry) return status;
+        }
+        return std::nullopt;
+    }
 
+    // performs steps requested in cli
+    void performRequestedSteps() {
+        auto build_start = Clock::now();
+        step_reports.clear();
         std::vector<Step*> all_steps_flat;
         for (auto& step : steps) all_steps_flat.push_back(&step);
         // perform requested steps in order
@@ -1114,38 +3354,269 @@ public:
             std::swap(steps_run_order[i], steps_run_order[steps_run_order.size() - i - 1]);
         }
 
-        std::mutex queue_mutex;
-        std::vector<std::thread> worker_threads;
-        for (size_t i = 0; i < max_parallel_jobs; i++) {
-            worker_threads.emplace_back([this, &queue_mutex, &steps_run_order]() {
-                try {
-                    while (true) {
-                        Step* step = nullptr;
-                        {
-                            std::lock_guard<std::mutex> lock(queue_mutex);
-                            if (steps_run_order.empty()) return;
-                            step = steps_run_order.back();
-                            steps_run_order.pop_back();
-                        }
-                        for (auto dep : step->deps) {
-                            dep->waitUntilCompleted();
-                        }
-                        for (auto dep : step->inputs) {
-                            if (!dep.step) continue;
-                            dep.step->waitUntilCompleted();
-                        }
+        step_name_uses.clear();
+        assignUniqueNames(this);
+        if (explain) loadKeyRecords();
+        prehashInputs(steps_run_order);
+        setupJobserver();
+        progressStart(steps_run_order);
+        openEvents(steps_run_order.size());
+        runScheduler(steps_run_order);
+        closeEvents();
+        progressStop();
+        teardownJobserver();
+        if (time_trace) reportTimeTraces(steps_run_order);
+        saveStepHistory();
+        if (token_hashes_dirty) saveTokenHashes();
+        saveKeyRecords();
+        if (!report_path.empty()) renderAndDumpBuildReport(report_path, Clock::now() - build_start);
+    }
+
+    // steps of different targets may share name (main.o of exe and of lib, or of subproject), so every one after the
+    // first gets "#<n>" appended, in order of creation. steps added by dyndep callbacks are named once they join build
+    void assignUniqueName(Step* step) {
+        auto n = ++step_name_uses[step->opts.name];
+        step->unique_name = n == 1 ? step->opts.name : step->opts.name + "#" + std::to_string(n);
+    }
+
+    void assignUniqueNames(Build* build) {
+        for (auto* step : build->step_order) assignUniqueName(step);
+        for (auto& sub : build->sub_builds) assignUniqueNames(sub.b.get());
+    }
+
+    // hashes sources of objs about to be built and headers their depfiles from previous builds list, all together, so
+    // computing keys of steps is mostly lookups into hash cache. headers of sources that must be scanned again, and
+    // inputs that depend on outputs of other steps, are hashed when keys are computed as before. files inside of out
+    // and cache are skipped too: steps of this run may write them (generated headers installed to out), and hash of
+    // them taken before that would stay in hash cache for the rest of run
+    void prehashInputs(const std::vector<Step*>& steps_run_order) {
+        std::unordered_set<Step*> scheduled(steps_run_order.begin(), steps_run_order.end());
+        auto fromSteps = [](const std::vector<LazyPath>& paths) {
+            return std::any_of(paths.begin(), paths.end(), [](const LazyPath& lp) { return lp.step != nullptr; });
+        };
+        std::vector<Obj*> scheduled_objs;
+        std::vector<Path> sources;
+        for (auto& obj : objs) {
+            if (scheduled.count(obj.step) == 0 || obj.opts.generated_source) continue;
+            auto flags = applyFlagsOverlay(global_flags, &obj.opts.flags);
+            if (fromSteps(flags.include_paths) || fromSteps(flags.library_paths) || fromSteps(flags.libraries)) continue;
+            if (isInsideDir(obj.opts.source, out) || isInsideDir(obj.opts.source, cache)) continue;
+            scheduled_objs.push_back(&obj);
+            sources.push_back(obj.opts.source);
+        }
+        hashFiles(sources);
+
+        std::vector<std::vector<Path>> deps(scheduled_objs.size());
+        parallelFor(scheduled_objs.size(), [&](size_t i) {
+            auto scan_h = depScanHash(scheduled_objs[i]->opts, scheduled_objs[i]->opts.source);
+            if (!cacheEntryExists(scan_h)) return;
+            auto compiler = compilerInfo(applyFlagsOverlay(global_flags, &scheduled_objs[i]->opts.flags).compile_driver);
+            for (const auto& dep : parseDepfile(cacheEntryGetPath(scan_h))) {
+                if (isSystemHeader(compiler, dep) || isInsideDir(dep, out) || isInsideDir(dep, cache)) continue;
+                deps[i].push_back(dep);
+            }
+        });
+        std::unordered_set<Path> seen;
+        std::vector<Path> headers;
+        for (const auto& list : deps) {
+            for (const auto& dep : list) {
+                if (seen.insert(dep).second) headers.push_back(dep);
+            }
+        }
+        hashFiles(headers);
+        if (source_hashing != SourceHashing::Bytes) {
+            parallelFor(sources.size(), [&](size_t i) { (void)sourceHash(sources[i]); });
+            parallelFor(headers.size(), [&](size_t i) { (void)sourceHash(headers[i]); });
+        }
+        if (verbose) blog("Prehashed %zu sources and %zu files from their depfiles\n", sources.size(), headers.size());
+    }
+
+    const Pool& poolOf(Step* step) {
+        static const Pool default_pool{};
+        if (step->opts.pool.empty()) return default_pool;
+        auto it = pools.find(step->opts.pool);
+        if (it == pools.end()) panic("Step %s uses unknown pool \"%s\", declare it with addPool()\n", step->opts.name.c_str(), step->opts.pool.c_str());
+        return it->second;
+    }
+
+    // performs steps (popped from back) as soon as their dependencies are completed and both job slot (if needed)
+    // and pool allow it. workers are max_parallel_jobs plus one per running step that does not take job slot
+    static std::vector<Step*> stepDeps(Step* step) {
+        auto res = step->deps;
+        for (auto input : step->inputs) {
+            if (input.step) res.push_back(input.step);
+        }
+        return res;
+    }
+
+    void runScheduler(std::vector<Step*> steps_run_order) {
+        std::unordered_map<Step*, size_t> pending_deps;
+        std::unordered_map<Step*, std::vector<Step*>> dependants;
+        std::unordered_map<Step*, std::vector<Step*>> known_deps; // edges scheduler knows of, dyndep callbacks may add more
+        std::unordered_set<Step*> started;
+        std::deque<Step*> ready; // in order of steps_run_order, so requested steps go in requested order
+        auto schedule = [&](Step* step) {
+            poolOf(step); // fail early on unknown pool
+            size_t pending = 0;
+            known_deps[step] = stepDeps(step);
+            for (auto* dep : known_deps[step]) {
+                if (dep->threadSafeIsCompleted()) continue;
+                dependants[dep].push_back(step);
+                pending++;
+            }
+            pending_deps[step] = pending;
+            if (pending == 0) {
+                ready.push_back(step);
+                emitStepEvent("scheduled", step, ",\"queue\":" + std::to_string(ready.size()), false);
+            }
+        };
+        for (auto it = steps_run_order.rbegin(); it != steps_run_order.rend(); ++it) schedule(*it);
+        flushEvents();
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t remaining = steps_run_order.size();
+        bool dyndep_running = false; // one callback at a time, as they edit the graph
+
+        // after dyndep callback: steps it made that scheduled steps now depend on join the build, and new dependencies of
+        // scheduled steps are waited for. callback itself runs without mutex, but while dyndep_running no step is started,
+        // so it may append dependencies to any step that is not running yet
+        auto incorporateDyndep = [&](Step* source) {
+            std::vector<Step*> added; // deps first
+            std::unordered_map<Step*, int> marks; // 1 - being visited, 2 - visited
+            std::vector<Step*> path;
+            std::function<void(Step*)> visit = [&](Step* step) {
+                if (step->threadSafeIsCompleted() || marks[step] == 2) return;
+                if (marks[step] == 1) {
+                    std::string cycle;
+                    for (auto it = std::find(path.begin(), path.end(), step); it != path.end(); ++it) cycle += (*it)->opts.name + " -> ";
+                    panic("Dependency cycle after dyndep of step %s: %s%s\n", source->opts.name.c_str(), cycle.c_str(), step->opts.name.c_str());
+                }
+                marks[step] = 1;
+                path.push_back(step);
+                for (auto* dep : stepDeps(step)) visit(dep);
+                path.pop_back();
+                marks[step] = 2;
+                if (pending_deps.count(step) == 0) added.push_back(step);
+            };
+            std::vector<Step*> scheduled;
+            for (const auto& [step, deps] : known_deps) scheduled.push_back(step);
+            for (auto* step : scheduled) visit(step);
+
+            for (auto* step : scheduled) {
+                auto deps = stepDeps(step);
+                if (deps.size() == known_deps[step].size()) continue; // deps are only ever appended
+                if (started.count(step) > 0) {
+                    if (step == build_all_step) continue; // new objs of generated sources, nothing waits for it anymore
+                    panic("Dyndep of step %s added dependencies to step %s that has already started\n", source->opts.name.c_str(), step->opts.name.c_str());
+                }
+                size_t pending_before = pending_deps[step];
+                for (size_t i = known_deps[step].size(); i < deps.size(); i++) {
+                    if (deps[i]->threadSafeIsCompleted()) continue;
+                    dependants[deps[i]].push_back(step);
+                    pending_deps[step]++;
+                }
+                known_deps[step] = deps;
+                if (pending_before == 0 && pending_deps[step] > 0) ready.erase(std::find(ready.begin(), ready.end(), step));
+            }
+            for (auto* step : added) {
+                if (step->unique_name.empty()) assignUniqueName(step);
+                schedule(step);
+            }
+            remaining += added.size();
+            progressStepsAdded(added);
+            flushEvents();
+        };
+        int free_slots = max_parallel_jobs;
+        int workers = 0;
+        int running_without_slot = 0;
+        std::unordered_map<std::string, int> pool_running;
+        std::list<std::thread> threads;
+        auto admissible = [&](Step* step) {
+            auto& pool = poolOf(step);
+            if (pool.depth > 0 && pool_running[step->opts.pool] >= pool.depth) return false;
+            return !pool.takes_job_slot || free_slots > 0;
+        };
 
-                        performStepIfNeeded(step);
+        std::function<void()> worker = [&]() {
+            try {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (remaining > 0) {
+                    auto it = dyndep_running ? ready.end() : std::find_if(ready.begin(), ready.end(), admissible);
+                    if (it == ready.end()) {
+                        cv.wait(lock);
+                        continue;
+                    }
+                    auto* step = *it;
+                    ready.erase(it);
+                    started.insert(step);
+                    emitStepEvent("started", step, ",\"queue\":" + std::to_string(ready.size()));
+                    auto& pool = poolOf(step);
+                    pool_running[step->opts.pool]++;
+                    if (pool.takes_job_slot) {
+                        free_slots--;
+                    } else {
+                        running_without_slot++;
                     }
-                } catch (const std::exception& e) {
-                    panic("Worker thread caught exception: %s\n", e.what());
+                    if (workers < max_parallel_jobs + running_without_slot) {
+                        workers++; // this worker does not hold job slot now, someone must be ready to take it
+                        threads.emplace_back(worker);
+                    }
+                    lock.unlock();
+
+                    performStepIfNeeded(step);
+
+                    lock.lock();
+                    if (step->dyndep) {
+                        cv.wait(lock, [&]() { return !dyndep_running; });
+                        dyndep_running = true;
+                        lock.unlock();
+                        dyndep_thread = std::this_thread::get_id();
+                        step->dyndep(cacheEntryOfStep(step));
+                        dyndep_thread = {};
+                        lock.lock();
+                        dyndep_running = false;
+                        incorporateDyndep(step);
+                    }
+                    pool_running[step->opts.pool]--;
+                    if (pool.takes_job_slot) {
+                        free_slots++;
+                    } else {
+                        running_without_slot--;
+                    }
+                    remaining--;
+                    for (auto* dependant : dependants[step]) {
+                        if (--pending_deps[dependant] == 0) {
+                            ready.push_back(dependant);
+                            emitStepEvent("scheduled", dependant, ",\"queue\":" + std::to_string(ready.size()), false);
+                        }
+                    }
+                    flushEvents();
+                    cv.notify_all();
+                    if (workers > max_parallel_jobs + running_without_slot) break; // extra worker is not needed anymore
                 }
-            });
-        }
+                workers--;
+            } catch (const std::exception& e) {
+                panic("Worker thread caught exception: %s\n", e.what());
+            }
+        };
 
-        for (auto& thread : worker_threads) {
-            thread.join();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int i = 0; i < max_parallel_jobs; i++) {
+                workers++;
+                threads.emplace_back(worker);
+            }
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!cv.wait_for(lock, std::chrono::milliseconds(250), [&]() { return remaining == 0; })) {
+                lock.unlock();
+                progressDraw(true); // keeps ETA and elapsed time moving while nothing completes
+                lock.lock();
+            }
         }
+        for (auto& thread : threads) thread.join(); // no new threads once everything is done
     }
 
     std::vector<Path> completedInputs(Step* step) {
@@ -1171,19 +3642,531 @@ public:
         }
     }
 
-    void recompileBuildScriptIfChanged() {
-        auto new_hash = buildEntireSourceFileHashCached({.flags = {.compile_driver = BPP_RECOMPILE_SELF_CMD}}, root / "build.cpp");
+    // only change of buildpp.h itself (layout of Build may differ) requires relinking and re-executing the tool,
+    // edits of build.cpp are handled by loadBuildScript
+    void checkBuildScript() {
+        std::vector<Path> script_deps;
+        auto new_hash = buildEntireSourceFileHashCached({.flags = {.compile_driver = BPP_RECOMPILE_SELF_CMD}}, root / "build.cpp", &script_deps);
+        auto header_hash = new_hash; // header not found among script deps, so any change requires relinking
+        for (const auto& dep : script_deps) {
+            if (dep.filename() == Path{__FILE__}.filename()) header_hash = hashFile(dep);
+        }
+
         // this if helps avoid rebuilding tool if cache is purged completely
+        std::ifstream header_hash_file{selfHeaderHashPath()};
+        if (!header_hash_file.is_open()) recompileSelf(new_hash, header_hash, "build tool hash file missing, can't verify self-consistency");
+        Hash old_header_hash{0};
+        header_hash_file >> old_header_hash.value;
+        header_hash_file.close();
+        if (old_header_hash.value != header_hash.value) recompileSelf(new_hash, header_hash, "buildpp.h changed");
+        self_hash = new_hash;
+        for (const auto& dep : script_deps) self_deps.push_back({dep, hashFile(dep)});
+    }
+
+    // whether build script or anything it includes changed since checkBuildScript()
+    bool buildScriptChanged() {
+        for (const auto& [dep, hash] : self_deps) {
+            std::error_code ec;
+            if (!std::filesystem::exists(dep, ec) || hashFile(dep).value != hash.value) return true;
+        }
+        return false;
+    }
+
+    // decides which configure() to run. edited build.cpp is compiled into shared library keyed by script hash and loaded
+    // into this process
+    ConfigureFn loadBuildScript(ConfigureFn linked) {
+        // script is the same as the one linked into this binary
+        Hash linked_hash{0};
         std::ifstream hash_file{selfHashPath()};
-        if (!hash_file.is_open()) recompileSelf(new_hash, "build tool hash file missing, can't verify self-consistency");
-        Hash old_hash{0};
-        hash_file >> old_hash.value;
+        if (hash_file.is_open()) hash_file >> linked_hash.value;
         hash_file.close();
-        if (old_hash.value != new_hash.value) recompileSelf(new_hash, "source hashes differ");
+        if (linked_hash.value == self_hash.value) return linked;
+
+        auto lib = compileBuildScriptPlugin(self_hash, root / "build.cpp", "build script");
+        return loadConfigureStable(lib, &script_handle);
     }
 
 private:
-    void cmdRenderCXXFlags(std::string* cmd, CXXFlagsOverlay flags_overlay) {
+    static constexpr int32_t server_status_retry = -1;
+    static constexpr int32_t server_status_build_locally = -2;
+    static constexpr int server_stale_exit_code = 75; // forked request handler found graph outdated
+    static constexpr int server_other_config_exit_code = 76; // request has options server was not configured with
+
+    // option() lookups leave empty entries in parsed_options, those are not given by user
+    std::map<std::string, std::string> givenOptions() {
+        std::map<std::string, std::string> given;
+        for (const auto& [key, value] : parsed_options) {
+            if (value.has_value()) given[key] = *value;
+        }
+        return given;
+    }
+
+    // holds one jobserver token while alive. no-op outside of build phase
+    struct JobToken {
+        Build* b;
+        char byte = 0;
+        bool implicit = false;
+        bool held = false;
+
+        explicit JobToken(Build* b, bool needed = true) : b(b) {
+            if (!needed || b->jobserver_read_fd < 0) return;
+            while (true) {
+                bool expected = false;
+                if (b->jobserver_implicit_taken.compare_exchange_strong(expected, true)) {
+                    implicit = held = true;
+                    return;
+                }
+                // wait with timeout, implicit token may be freed by other worker meanwhile
+                pollfd pfd{.fd = b->jobserver_read_fd, .events = POLLIN};
+                if (::poll(&pfd, 1, 50) <= 0) continue;
+                auto n = ::read(b->jobserver_read_fd, &byte, 1);
+                if (n == 1) {
+                    held = true;
+                    return;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue; // other process was faster
+                panic("Jobserver closed unexpectedly\n");
+            }
+        }
+
+        ~JobToken() {
+            if (!held) return;
+            if (implicit) {
+                b->jobserver_implicit_taken = false;
+                return;
+            }
+            while (::write(b->jobserver_write_fd, &byte, 1) < 0 && errno == EINTR) {}
+        }
+
+        JobToken(const JobToken&) = delete;
+        JobToken& operator=(const JobToken&) = delete;
+    };
+
+    // waits until recorded peak memory of step fits into free memory. memory of running steps is already accounted
+    // there, so it is not reserved again. first step is always admitted, otherwise build would never finish
+    struct MemoryAdmission {
+        Build* b;
+
+        MemoryAdmission(Build* b, Step* step) : b(b) {
+            uint64_t rss_kb = 0;
+            if (auto it = b->step_history.find(step->unique_name); it != b->step_history.end()) rss_kb = it->second.peak_rss_kb;
+            std::unique_lock<std::mutex> lock(b->admission_mutex);
+            while (b->admitted_steps > 0 && rss_kb * 1024 > memoryHeadroom()) {
+                b->admission_cv.wait_for(lock, std::chrono::milliseconds(100)); // free memory changes on its own too
+            }
+            b->admitted_steps++;
+        }
+
+        ~MemoryAdmission() {
+            std::lock_guard<std::mutex> lock(b->admission_mutex);
+            b->admitted_steps--;
+            b->admission_cv.notify_all();
+        }
+
+        MemoryAdmission(const MemoryAdmission&) = delete;
+        MemoryAdmission& operator=(const MemoryAdmission&) = delete;
+    };
+
+    // joins jobserver of make that started us, or becomes jobserver for our own children. tokens limit number of
+    // running actions, so nested builds share max_parallel_jobs with our workers instead of multiplying it
+    void setupJobserver() {
+        jobserver_implicit_taken = false;
+        if (connectToParentJobserver()) return;
+
+        jobserver_fifo = newTmpPath();
+        if (mkfifo(jobserver_fifo.c_str(), 0600) != 0) panic("Failed to create jobserver fifo %s: %s\n", jobserver_fifo.c_str(), strerror(errno));
+        int fd = ::open(jobserver_fifo.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) panic("Failed to open jobserver fifo %s: %s\n", jobserver_fifo.c_str(), strerror(errno));
+        jobserver_read_fd = jobserver_write_fd = fd;
+        std::string tokens(std::max(max_parallel_jobs - 1, 0), '+');
+        if (::write(fd, tokens.data(), tokens.size()) != static_cast<ssize_t>(tokens.size())) panic("Failed to fill jobserver fifo: %s\n", strerror(errno));
+        auto makeflags = " -j" + std::to_string(max_parallel_jobs) + " --jobserver-auth=";
+        static const bool fifo_supported = makeSupportsFifoJobserver();
+        if (fifo_supported) {
+            makeflags += "fifo:" + jobserver_fifo.string();
+        } else {
+            jobserver_inherited_fd = ::open(jobserver_fifo.c_str(), O_RDWR);
+            if (jobserver_inherited_fd < 0) panic("Failed to open jobserver fifo %s: %s\n", jobserver_fifo.c_str(), strerror(errno));
+            makeflags += std::to_string(jobserver_inherited_fd) + "," + std::to_string(jobserver_inherited_fd);
+        }
+        setenv("MAKEFLAGS", makeflags.c_str(), 1);
+    }
+
+    // fifo jobserver appeared in GNU make 4.4, older one fails hard when it sees it
+    static bool makeSupportsFifoJobserver() {
+        auto* pipe = popen("make --version 2>/dev/null", "r");
+        if (!pipe) return true;
+        int major = 0, minor = 0;
+        bool is_gnu_make = std::fscanf(pipe, "GNU Make %d.%d", &major, &minor) == 2;
+        pclose(pipe);
+        if (!is_gnu_make) return true; // no make, ninja supports only fifo
+        return major > 4 || (major == 4 && minor >= 4);
+    }
+
+    bool connectToParentJobserver() {
+        auto makeflags = std::getenv("MAKEFLAGS");
+        if (!makeflags) return false;
+        std::string auth;
+        std::istringstream words{makeflags};
+        for (std::string word; words >> word;) { // last one wins, same as in make
+            for (std::string_view prefix : {"--jobserver-auth=", "--jobserver-fds="}) {
+                if (word.rfind(prefix, 0) == 0) auth = word.substr(prefix.size());
+            }
+        }
+        if (auth.empty()) return false;
+
+        Colorizer c{stdout};
+        if (auth.rfind("fifo:", 0) == 0) {
+            auto fifo = auth.substr(5);
+            int fd = ::open(fifo.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+            if (fd < 0) {
+                blog("buildpp: %swarning:%s failed to open jobserver fifo %s, ignoring parent jobserver\n", c.yellow(), c.reset(), fifo.c_str());
+                return false;
+            }
+            jobserver_read_fd = jobserver_write_fd = fd;
+            return true;
+        }
+        int read_fd = -1, write_fd = -1;
+        if (std::sscanf(auth.c_str(), "%d,%d", &read_fd, &write_fd) != 2) return false;
+        if (read_fd < 0 || write_fd < 0 || fcntl(read_fd, F_GETFD) < 0 || fcntl(write_fd, F_GETFD) < 0) {
+            blog("buildpp: %swarning:%s jobserver fds %s are not inherited (prefix make recipe with '+'), ignoring parent jobserver\n", c.yellow(), c.reset(), auth.c_str());
+            return false;
+        }
+        jobserver_read_fd = read_fd;
+        jobserver_write_fd = write_fd;
+        return true;
+    }
+
+    void teardownJobserver() {
+        if (!jobserver_fifo.empty()) {
+            ::close(jobserver_read_fd);
+            ::unlink(jobserver_fifo.c_str());
+            jobserver_fifo.clear();
+        }
+        if (jobserver_inherited_fd >= 0) ::close(jobserver_inherited_fd);
+        jobserver_inherited_fd = -1;
+        jobserver_read_fd = jobserver_write_fd = -1;
+    }
+
+    // nested build run by step action takes its parallelism from jobserver
+    std::string cmakeParallelFlag() {
+        if (jobserver_read_fd >= 0) return "";
+        return " -j" + std::to_string(max_parallel_jobs);
+    }
+
+    static Path serverSocketPath(Dir cache_dir) {
+        return cache_dir / "bpp.sock";
+    }
+
+    static int connectToServer(Path socket_path) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (socket_path.string().size() >= sizeof(addr.sun_path)) return -1;
+        std::strcpy(addr.sun_path, socket_path.c_str());
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    // keeps configured graph, file hashes and parsed depfiles in memory and serves build requests of thin clients.
+    // every request is handled by forked copy of this process, so failing build does not bring server down,
+    // and caches it filled are sent back to us through pipe
+    void serve() {
+        static char socket_path_for_signal[sizeof(sockaddr_un::sun_path)] = {};
+        auto socket_path = serverSocketPath(cache);
+        if (socket_path.string().size() >= sizeof(socket_path_for_signal)) panic("Server socket path %s is too long, use shorter BPP_CACHE_PREFIX\n", socket_path.c_str());
+        std::strcpy(socket_path_for_signal, socket_path.c_str());
+
+        int listen_fd = -1;
+        if (auto env_fd = std::getenv("BPP_SERVER_FD")) { // restarted ourselves, socket is inherited with pending clients
+            listen_fd = std::atoi(env_fd);
+            unsetenv("BPP_SERVER_FD");
+            fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
+        } else {
+            if (int fd = connectToServer(socket_path); fd >= 0) {
+                ::close(fd);
+                panic("Build server is already running on %s\n", socket_path.c_str());
+            }
+            ::unlink(socket_path.c_str());
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            std::strcpy(addr.sun_path, socket_path.c_str());
+            listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (listen_fd < 0) panic("Failed to create server socket: %s\n", strerror(errno));
+            if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) panic("Failed to bind server socket %s: %s\n", socket_path.c_str(), strerror(errno));
+            if (::listen(listen_fd, 64) != 0) panic("Failed to listen on server socket %s: %s\n", socket_path.c_str(), strerror(errno));
+        }
+
+        auto stop = [](int) {
+            ::unlink(socket_path_for_signal);
+            _exit(0);
+        };
+        signal(SIGINT, stop);
+        signal(SIGTERM, stop);
+        signal(SIGPIPE, SIG_IGN);
+
+        Colorizer c{stdout};
+        blog("%s[server]%s listening on %s\n", c.gray(), c.reset(), socket_path.c_str());
+        auto served_options = givenOptions();
+        auto served_cli_args = cli_args;
+        while (true) {
+            int conn = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn < 0) {
+                if (errno == EINTR) continue;
+                panic("Failed to accept build request: %s\n", strerror(errno));
+            }
+            auto start = Clock::now();
+            int32_t status = serveRequest(conn, listen_fd, served_options, served_cli_args);
+            if (status == server_stale_exit_code) {
+                // let client repeat request and restart to configure from scratch, keeping socket and its queue
+                status = server_status_retry;
+                sendAll(conn, &status, sizeof(status));
+                ::close(conn);
+                blog("%s[server]%s build script changed, restarting\n", c.gray(), c.reset());
+                int flags = fcntl(listen_fd, F_GETFD);
+                fcntl(listen_fd, F_SETFD, flags & ~FD_CLOEXEC);
+                setenv("BPP_SERVER_FD", std::to_string(listen_fd).c_str(), 1);
+                execv(saved_argv[0], saved_argv.data());
+                panic("Failed to restart build server: %s\n", strerror(errno));
+            }
+            if (status == server_other_config_exit_code) status = server_status_build_locally;
+            sendAll(conn, &status, sizeof(status));
+            ::close(conn);
+            auto end = Clock::now();
+            blog("%s[server]%s request done with code %d in %.3fs\n", c.gray(), c.reset(), status, std::chrono::duration<double>(end - start).count());
+        }
+    }
+
+    // returns exit code of request
+    int serveRequest(int conn, int listen_fd, const std::map<std::string, std::string>& served_options, const std::vector<std::string>& served_cli_args) {
+        uint64_t size = 0;
+        int fds[3] = {-1, -1, -1};
+        char control[CMSG_SPACE(sizeof(fds))] = {};
+        iovec iov{.iov_base = &size, .iov_len = sizeof(size)};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(size)) return 1;
+        auto* cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) return 1;
+        std::memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        std::string payload(size, '\0');
+        bool received = recvAll(conn, payload.data(), payload.size());
+
+        if (!received) {
+            for (int fd : fds) ::close(fd);
+            return 1;
+        }
+        revalidateHashCache(); // files may have changed since previous request
+        auto status = runForked(conn, [&]() {
+            ::close(listen_fd);
+            ::close(conn);
+            for (int i = 0; i < 3; i++) dup2(fds[i], i);
+            for (int fd : fds) ::close(fd);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            return handleForkedRequest(payload, served_options, served_cli_args);
+        });
+        for (int fd : fds) ::close(fd);
+        return status;
+    }
+
+    // runs body in forked copy of this process and brings caches it filled back. if cancel_fd is given, child
+    // gets its own process group, which is killed as soon as cancel_fd becomes readable or hangs up.
+    // returns exit code of child
+    int runForked(int cancel_fd, std::function<int()> body) {
+        int pipe_fds[2];
+        if (::pipe2(pipe_fds, O_CLOEXEC) != 0) return 1;
+        fflush(NULL);
+        auto pid = fork();
+        if (pid == 0) {
+            if (cancel_fd >= 0) setpgid(0, 0);
+            ::close(pipe_fds[0]);
+            auto code = body();
+            fflush(NULL);
+
+            CacheWriter w;
+            exportRuntimeCaches(&w);
+            size_t written = 0;
+            while (written < w.buf.size()) {
+                auto n = ::write(pipe_fds[1], w.buf.data() + written, w.buf.size() - written);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                written += n;
+            }
+            _exit(code);
+        }
+        ::close(pipe_fds[1]);
+        if (pid < 0) {
+            ::close(pipe_fds[0]);
+            return 1;
+        }
+
+        std::string exported;
+        pollfd pfds[2] = {{.fd = pipe_fds[0], .events = POLLIN}, {.fd = cancel_fd, .events = POLLIN}};
+        while (true) {
+            if (::poll(pfds, 2, -1) < 0 && errno != EINTR) break;
+            if (pfds[1].revents) {
+                kill(-pid, SIGTERM);
+                pfds[1].fd = -1;
+            }
+            if (pfds[0].revents) {
+                char buf[64 * 1024];
+                auto n = ::read(pipe_fds[0], buf, sizeof(buf));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) break;
+                exported.append(buf, n);
+            }
+        }
+        ::close(pipe_fds[0]);
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+        CacheReader r{exported};
+        if (!exported.empty()) importRuntimeCaches(&r);
+        if (WIFEXITED(status)) return WEXITSTATUS(status);
+        return 128 + WTERMSIG(status);
+    }
+
+    // runs in forked process with client's stdio
+    int handleForkedRequest(const std::string& payload, const std::map<std::string, std::string>& served_options, const std::vector<std::string>& served_cli_args) {
+        CacheReader r{payload};
+        auto cwd = r.str();
+        std::vector<std::string> args(r.u64());
+        for (auto& arg : args) arg = r.str();
+        if (!r.ok || args.empty()) return 1;
+        if (::chdir(cwd.c_str()) != 0) panic("Failed to enter client directory %s\n", cwd.c_str());
+
+        std::vector<char*> argv;
+        for (auto& arg : args) argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        saved_argc = static_cast<int>(args.size());
+        saved_argv = argv;
+        requested_steps.clear();
+        parsed_options.clear();
+        cli_args.clear();
+        verbose = silent = report_help = server_mode = watch_mode = explain = false;
+        report_path.clear();
+        events_spec.clear();
+        max_parallel_jobs = -1;
+        parseCliArgs();
+
+        if (buildScriptChanged() || modulesChanged()) return server_stale_exit_code;
+        if (givenOptions() != served_options || cli_args != served_cli_args) return server_other_config_exit_code;
+
+        if (report_help) {
+            reportHelp();
+        } else {
+            performRequestedSteps();
+        }
+        return 0;
+    }
+
+    // rebuilds requested steps every time something they were built from changes. graph stays configured in this
+    // process, every rebuild is done by forked copy of it (see runForked), so only hashes of changed files are recomputed
+    void watch() {
+        int inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (inotify_fd < 0) panic("Failed to initialize inotify: %s\n", strerror(errno));
+        std::unordered_map<int, Path> watched_dirs; // wd -> dir
+        std::unordered_map<Path, int> dir_wds;
+        auto watchKnownFiles = [&]() {
+            std::vector<Path> paths;
+            for (const auto& [dep, hash] : self_deps) paths.push_back(dep);
+            runtime()->hash_cache.forEach([&](const Path& path, const FileHashEntry&) { paths.push_back(path); });
+            for (const auto& path : paths) {
+                auto dir = path.parent_path();
+                if (dir_wds.count(dir) > 0 || isInsideDir(dir, cache) || isInsideDir(dir, out)) continue;
+                // whole directory is watched, since editors often save files by renaming new version over old one
+                int wd = inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE);
+                dir_wds[dir] = wd; // failed ones are remembered too, so they are not retried every round
+                if (wd >= 0) watched_dirs[wd] = dir;
+            }
+        };
+
+        Colorizer c{stdout};
+        while (true) {
+            auto start = Clock::now();
+            auto code = runForked(-1, [&]() {
+                performRequestedSteps();
+                return 0;
+            });
+            auto end = Clock::now();
+            bool failed = code != 0;
+            if (failed) {
+                blog("%s[watch]%s %sbuild failed%s in %.3fs\n", c.gray(), c.reset(), c.red(), c.reset(), std::chrono::duration<double>(end - start).count());
+            } else {
+                blog("%s[watch]%s build done in %.3fs\n", c.gray(), c.reset(), std::chrono::duration<double>(end - start).count());
+            }
+            watchKnownFiles();
+            blog("%s[watch]%s watching %zu directories for changes...\n", c.gray(), c.reset(), watched_dirs.size());
+
+            // wait for first relevant change, then collect the rest of the burst until it settles down
+            std::vector<Path> changed;
+            bool overflow = false;
+            int timeout = -1;
+            while (true) {
+                pollfd pfd{.fd = inotify_fd, .events = POLLIN};
+                int ready = ::poll(&pfd, 1, timeout);
+                if (ready < 0 && errno == EINTR) continue;
+                if (ready < 0) panic("Failed to wait for file changes: %s\n", strerror(errno));
+                if (ready == 0) break; // quiet for long enough
+                alignas(inotify_event) char buf[64 * 1024];
+                while (true) {
+                    auto n = ::read(inotify_fd, buf, sizeof(buf));
+                    if (n <= 0) break;
+                    for (char* ptr = buf; ptr < buf + n;) {
+                        auto* event = reinterpret_cast<inotify_event*>(ptr);
+                        ptr += sizeof(inotify_event) + event->len;
+                        if (event->mask & IN_Q_OVERFLOW) overflow = true;
+                        if (event->len == 0 || watched_dirs.count(event->wd) == 0) continue;
+                        changed.push_back(watched_dirs[event->wd] / event->name);
+                    }
+                }
+                if (!overflow && !failed) {
+                    // files build never looked at, like editor swap files, do not trigger rebuild
+                    auto irrelevant = [&](const Path& path) { return !runtime()->hash_cache.contains(path) && !isSelfDep(path); };
+                    changed.erase(std::remove_if(changed.begin(), changed.end(), irrelevant), changed.end());
+                }
+                if (!changed.empty() || overflow) timeout = 100;
+            }
+
+            if (overflow) {
+                revalidateHashCache(); // do not know what changed, so check everything
+            } else {
+                for (const auto& path : changed) runtime()->hash_cache.erase(path);
+            }
+            if (overflow || !module_units.empty() || std::any_of(changed.begin(), changed.end(), [&](const Path& path) { return isSelfDep(path); })) {
+                if (buildScriptChanged() || modulesChanged()) {
+                    blog("%s[watch]%s build script changed, restarting\n", c.gray(), c.reset());
+                    fflush(NULL);
+                    execv(saved_argv[0], saved_argv.data());
+                    panic("Failed to restart: %s\n", strerror(errno));
+                }
+            }
+            std::sort(changed.begin(), changed.end());
+            changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+            blog("%s[watch]%s %zu files changed, rebuilding\n", c.gray(), c.reset(), changed.size());
+        }
+    }
+
+    bool isSelfDep(const Path& path) {
+        return std::any_of(self_deps.begin(), self_deps.end(), [&](const auto& dep) { return dep.first == path; });
+    }
+
+    static bool isInsideDir(const Path& path, const Dir& dir) {
+        auto rel = path.lexically_relative(dir);
+        return !rel.empty() && *rel.begin() != "..";
+    }
+
+    // lazy_path_keys renders include paths by identity, for keys that must not change with hashes of generator steps
+    void cmdRenderCXXFlags(std::string* cmd, CXXFlagsOverlay flags_overlay, bool lazy_path_keys = false) {
         auto flags = applyFlagsOverlay(global_flags, &flags_overlay);
         *cmd += flags.compile_driver;
         *cmd += " " + flags.extra_flags;
@@ -1210,7 +4193,7 @@ private:
             case CXXStandard::CXX20: *cmd += " -std=c++20"; break;
             case CXXStandard::CXX23: *cmd += " -std=c++23"; break;
         }
-        for (const auto& inc : flags.include_paths) *cmd += " -I" + resolveLazyPath(inc).string();
+        for (const auto& inc : flags.include_paths) *cmd += " -I" + (lazy_path_keys ? lazyPathKey(inc) : resolveLazyPath(inc).string());
         for (const auto& lib_path : flags.library_paths) *cmd += " -L" + resolveLazyPath(lib_path).string();
     }
 
@@ -1227,8 +4210,8 @@ private:
         if (whole->lto.value_or(global_lib_exe_flags.lto)) *cmd += " -flto";
     }
 
-    void cmdRenderCompileObj(std::string* cmd, ObjOpts obj, std::vector<Path> sources, std::vector<Path> inputs, Path out) {
-        cmdRenderCXXFlags(cmd, obj.flags);
+    void cmdRenderCompileObj(std::string* cmd, ObjOpts obj, std::vector<Path> sources, std::vector<Path> inputs, Path out, bool lazy_path_keys = false) {
+        cmdRenderCXXFlags(cmd, obj.flags, lazy_path_keys);
         cmdRenderWholeObjOpts(cmd, obj.opt_whole);
         
         for (auto src : sources) *cmd += " \"" + escapeStringJSON(src.string()) + "\"";
@@ -1269,23 +4252,32 @@ private:
         for (const auto& def : flags.defines) {
             hash = hash.combine(hashString(def.name));
             hash = hash.combine(hashString(def.value));
+            explainKeyItem("define", def.name, hashString(def.value));
         }
-        for (const auto& inc : flags.include_paths) {
-            hash = hash.combine(hashString(resolveLazyPath(inc).string()));
+        for (const auto& inc : flags.include_paths) { // headers found there are keyed by content through depfiles
+            hash = hash.combine(hashString(lazyPathKey(inc)));
+            explainKeyItem("include path", lazyPathKey(inc), {});
         }
         for (const auto& lib_path : flags.library_paths) {
             hash = hash.combine(hashString(resolveLazyPath(lib_path).string()));
+            explainKeyItem("library path", resolveLazyPath(lib_path).string(), {});
         }
         for (const auto& lib : flags.libraries) {
             hash = hash.combine(hashString(resolveLazyPath(lib).string()));
+            explainKeyItem("library", resolveLazyPath(lib).string(), {});
         }
         for (const auto& lib : flags.libraries_system) {
             hash = hash.combine(hashString(lib));
+            explainKeyItem("system library", lib, {});
         }
         hash = hash.combine(hashString(flags.extra_flags));
         hash = hash.combine(Hash{static_cast<uint64_t>(flags.optimize)});
         hash = hash.combine(Hash{static_cast<uint64_t>(flags.warnings)});
         hash = hash.combine(Hash{static_cast<uint64_t>(flags.standard)});
+        explainKeyItem("flag", "extra flags", hashString(flags.extra_flags));
+        explainKeyItem("flag", "optimize", Hash{static_cast<uint64_t>(flags.optimize)});
+        explainKeyItem("flag", "warnings", Hash{static_cast<uint64_t>(flags.warnings)});
+        explainKeyItem("flag", "standard", Hash{static_cast<uint64_t>(flags.standard)});
         return hash;
     }
 
@@ -1295,12 +4287,20 @@ private:
         h = h.combine(Hash{static_cast<uint64_t>(opts->debug_info.value_or(global_lib_exe_flags.debug_info))});
         h = h.combine(Hash{static_cast<uint64_t>(opts->asan.value_or(global_lib_exe_flags.asan))});
         h = h.combine(Hash{static_cast<uint64_t>(opts->lto.value_or(global_lib_exe_flags.lto))});
+        explainKeyItem("flag", "debug info", Hash{static_cast<uint64_t>(opts->debug_info.value_or(global_lib_exe_flags.debug_info))});
+        explainKeyItem("flag", "asan", Hash{static_cast<uint64_t>(opts->asan.value_or(global_lib_exe_flags.asan))});
+        explainKeyItem("flag", "lto", Hash{static_cast<uint64_t>(opts->lto.value_or(global_lib_exe_flags.lto))});
         return h;
     }
 
+    // generated source lives in cache entry of its step, so it is identified by step and output name instead
+    std::string objSourceKey(const ObjOpts& opts) {
+        return opts.generated_source ? lazyPathKey(*opts.generated_source) : opts.source.string();
+    }
+
     Hash hashObjOpts(const ObjOpts& opts) {
         auto h = hashCXXFlags(opts.flags);
-        h = h.combine(hashString(opts.source.string()));
+        h = h.combine(hashString(objSourceKey(opts)));
         h = h.combine(hashWholeObjOpts(opts.opt_whole));
         return h;
     }
@@ -1310,6 +4310,7 @@ private:
         h = h.combine(hashWholeObjOpts(&opts.exe_flags));
         h = h.combine(hashString(opts.name));
         h = h.combine(hashString(opts.desc));
+        explainKeyItem("description", "", hashString(opts.desc));
         return h;
     }
 
@@ -1319,6 +4320,8 @@ private:
         h = h.combine(hashString(opts.name));
         h = h.combine(hashString(opts.desc));
         h = h.combine(Hash{static_cast<uint64_t>(opts.static_lib)});
+        explainKeyItem("description", "", hashString(opts.desc));
+        explainKeyItem("flag", "static", Hash{static_cast<uint64_t>(opts.static_lib)});
         return h;
     }
 
@@ -1328,6 +4331,21 @@ private:
         return lp.path.empty() ? base : base / lp.path;
     }
 
+    // identity of lazy path that does not change with hash of its step, unlike its resolved cache location
+    std::string lazyPathKey(LazyPath lp) {
+        if (lp.step == nullptr) return (root / lp.path).string();
+        return lp.path.empty() ? lp.step->opts.name : lp.step->opts.name + "/" + lp.path.string();
+    }
+
+    // key contribution of completed input. declared output is keyed by its own content, so dependant is not rebuilt
+    // when generator reran and produced the same file, or changed only other outputs
+    Hash inputKey(LazyPath input) {
+        if (!input.step->declaresOutput(input.path)) return *input.step->hash;
+        auto path = resolveLazyPath(input);
+        auto content_h = std::filesystem::is_directory(path) ? hashDirRec(path) : hashFile(path);
+        return hashString(lazyPathKey(input)).combine(content_h);
+    }
+
     void reportHelp() {
         Colorizer c{stdout};
         log("%s%sBuild tool help:%s\n", c.cyan_bright(), c.bold(), c.reset());
@@ -1337,8 +4355,16 @@ private:
         log("%s  -h, --help%s               Show this help message\n", c.magenta(), c.reset());
         log("%s  -s, --silent%s             Silent mode, suppress output except errors\n", c.magenta(), c.reset());
         log("%s  -v, --verbose%s            Enable verbose output\n", c.magenta(), c.reset());
-        log("%s  -j, --jobs <num>%s         Set maximum parallel jobs (default: number of CPU cores)\n", c.magenta(), c.reset());
+        log("%s  -j, --jobs <num>%s         Set maximum parallel jobs (default: CPUs available to this cgroup, limited by its memory)\n", c.magenta(), c.reset());
         log("%s  --dump-compile-commands%s  Dump compile_commands.json file in root directory\n", c.magenta(), c.reset());
+        log("%s  --server%s                 Keep configured build in memory and serve builds of this project over unix socket\n", c.magenta(), c.reset());
+        log("%s  --no-server%s              Build in this process even if build server is running\n", c.magenta(), c.reset());
+        log("%s  --watch%s                  Rebuild requested steps every time their sources change\n", c.magenta(), c.reset());
+        log("%s  --report=<path>%s          Write json report of resources used by performed steps\n", c.magenta(), c.reset());
+        log("%s  --explain%s                Tell why steps were rebuilt, comparing their keys with the ones they were last built with\n", c.magenta(), c.reset());
+        log("%s  --events=<fd:N|path>%s     Stream build events as json lines to file descriptor or file\n", c.magenta(), c.reset());
+        log("%s  --time-trace%s             Compile objs with clang -ftime-trace, report slowest headers, templates and functions\n", c.magenta(), c.reset());
+        log("%s  --io-uring%s               Hash files in bulk through io_uring, helps with cold caches and network filesystems\n", c.magenta(), c.reset());
         for (const auto& [_, opt] : options) {
             log("%s  -D%s%s", c.magenta(), opt.key.c_str(), c.reset());
             if (!opt.description.empty()) log(" :: %s", opt.description.c_str());
@@ -1427,6 +4453,178 @@ private:
         writeEntireFile(out, res);
     }
 
+    // -ftime-trace output of obj, kept in cache next to the obj itself
+    static Hash timeTraceKey(Hash obj_h) {
+        return hashString("time trace").combine(obj_h);
+    }
+
+    // aggregates traces of scheduled objs, in the spirit of ClangBuildAnalyzer. durations are inclusive, so nested
+    // headers and instantiations are counted in their parents as well
+    void reportTimeTraces(const std::vector<Step*>& scheduled_steps) {
+        struct Total {
+            uint64_t us = 0;
+            size_t count = 0;
+        };
+        using Totals = std::unordered_map<std::string, Total>;
+        Totals frontend, backend, headers, templates, template_sets, functions;
+        uint64_t frontend_us = 0, backend_us = 0;
+        size_t traced = 0, untraced = 0;
+        std::unordered_set<Step*> scheduled(scheduled_steps.begin(), scheduled_steps.end());
+        for (auto& obj : objs) {
+            if (!scheduled.count(obj.step) || !obj.step->hash) continue;
+            auto trace_h = timeTraceKey(*obj.step->hash);
+            JsonValue json;
+            if (!cacheEntryExists(trace_h) || !parseJson(readEntireFile(cacheEntryGetPath(trace_h)), &json) || !json.get("traceEvents")) {
+                untraced++;
+                continue;
+            }
+            traced++;
+            for (const auto& event : json.get("traceEvents")->array) {
+                auto* name = event.get("name");
+                auto* dur = event.get("dur");
+                if (!name || !dur) continue;
+                auto us = static_cast<uint64_t>(dur->number);
+                auto* args = event.get("args");
+                auto* detail_value = args ? args->get("detail") : nullptr;
+                auto detail = detail_value ? detail_value->string : std::string{};
+                auto add = [&](Totals& totals, const std::string& key) {
+                    auto& total = totals[key];
+                    total.us += us;
+                    total.count++;
+                };
+                if (name->string == "Frontend") {
+                    add(frontend, objSourceKey(obj.opts));
+                    frontend_us += us;
+                } else if (name->string == "Backend") {
+                    add(backend, objSourceKey(obj.opts));
+                    backend_us += us;
+                } else if (name->string == "Source") {
+                    add(headers, detail);
+                } else if (name->string == "InstantiateClass" || name->string == "InstantiateFunction") {
+                    add(templates, detail);
+                    add(template_sets, detail.substr(0, detail.find('<')) + (detail.find('<') != std::string::npos ? "<$>" : ""));
+                } else if (name->string == "OptFunction") {
+                    add(functions, detail);
+                }
+            }
+        }
+
+        Colorizer c{stdout};
+        log("%s%sTime trace:%s %zu objs traced", c.cyan(), c.bold(), c.reset(), traced);
+        if (untraced > 0) log(", %zu without trace (not built by clang)", untraced);
+        log("\n");
+        if (traced == 0) return;
+        log("  parsing (frontend) %.2fs, codegen and optimization (backend) %.2fs\n", frontend_us / 1e6, backend_us / 1e6);
+        auto section = [&](const char* title, const Totals& totals, const char* counted) {
+            if (totals.empty()) return;
+            std::vector<std::pair<std::string, Total>> top(totals.begin(), totals.end());
+            constexpr size_t max_rows = 10;
+            auto rows = std::min(top.size(), max_rows);
+            std::partial_sort(top.begin(), top.begin() + rows, top.end(), [](const auto& a, const auto& b) { return a.second.us > b.second.us; });
+            log("%s%s%s\n", c.cyan(), title, c.reset());
+            for (size_t i = 0; i < rows; i++) {
+                const auto& [what, total] = top[i];
+                log("  %s%6llu ms%s %s", c.yellow(), static_cast<unsigned long long>(total.us / 1000), c.reset(), what.c_str());
+                if (counted) log(" %s(%zu %s, avg %llu ms)%s", c.gray(), total.count, counted, static_cast<unsigned long long>(total.us / 1000 / total.count), c.reset());
+                log("\n");
+            }
+        };
+        section("Files that took longest to parse:", frontend, nullptr);
+        section("Files that took longest to codegen:", backend, nullptr);
+        section("Templates that took longest to instantiate:", templates, "times");
+        section("Template sets that took longest to instantiate:", template_sets, "times");
+        section("Functions that took longest to compile:", functions, "times");
+        section("Expensive headers:", headers, "includes");
+    }
+
+    // resources used by performed steps, summed up per target (objs are accounted to exe or lib they are linked into)
+    void renderAndDumpBuildReport(Path out, Clock::duration wall) {
+        auto renderUsage = [](uint64_t wall_us, const ProcessUsage& usage) {
+            std::string res;
+            res += "\"wall_ms\":" + std::to_string(wall_us / 1000);
+            res += ",\"user_ms\":" + std::to_string(usage.user_us / 1000);
+            res += ",\"sys_ms\":" + std::to_string(usage.sys_us / 1000);
+            res += ",\"peak_rss_kb\":" + std::to_string(usage.peak_rss_kb);
+            res += ",\"read_bytes\":" + std::to_string(usage.read_bytes);
+            res += ",\"write_bytes\":" + std::to_string(usage.write_bytes);
+            return res;
+        };
+
+        struct Target {
+            std::string kind;
+            std::string name;
+            size_t steps = 0;
+            uint64_t wall_us = 0;
+            ProcessUsage usage;
+        };
+        std::list<Target> targets;
+        std::unordered_map<Step*, Target*> target_of;
+        for (auto& exe : exes) {
+            auto* target = &targets.emplace_back(Target{.kind = "Exe", .name = exe.opts.name});
+            target_of[exe.link_step] = target;
+            for (auto in : exe.link_step->inputs) {
+                if (in.step && !target_of.count(in.step)) target_of[in.step] = target;
+            }
+        }
+        for (auto& lib : libs) {
+            auto* target = &targets.emplace_back(Target{.kind = "Lib", .name = lib.libName()});
+            target_of[lib.link_step] = target;
+            for (auto in : lib.link_step->inputs) {
+                if (in.step && !target_of.count(in.step)) target_of[in.step] = target;
+            }
+        }
+        for (auto& obj : objs) {
+            if (target_of.count(obj.step)) continue;
+            target_of[obj.step] = &targets.emplace_back(Target{.kind = "Obj", .name = obj.step->opts.name});
+        }
+
+        ProcessUsage total;
+        for (const auto& report : step_reports) {
+            total.add(report.usage);
+            auto it = target_of.find(report.step);
+            if (it == target_of.end()) continue;
+            it->second->steps++;
+            it->second->wall_us += report.wall_us;
+            it->second->usage.add(report.usage);
+        }
+
+        auto res = std::string{};
+        res += "{\n";
+        res += "  \"total\": {\"steps\":" + std::to_string(step_reports.size()) + "," + renderUsage(std::chrono::duration_cast<std::chrono::microseconds>(wall).count(), total) + "},\n";
+        res += "  \"targets\": [";
+        bool first = true;
+        for (const auto& target : targets) {
+            if (target.steps == 0) continue;
+            res += first ? "\n" : ",\n";
+            first = false;
+            res += "    {\"kind\":\"" + target.kind + "\",\"name\":\"" + escapeStringJSON(target.name) + "\",\"steps\":" + std::to_string(target.steps) + "," + renderUsage(target.wall_us, target.usage) + "}";
+        }
+        res += "\n  ],\n";
+
+        // steps that are worst by each metric
+        auto renderTop = [&](const char* key, auto metric) {
+            auto sorted = step_reports;
+            std::stable_sort(sorted.begin(), sorted.end(), [&](const StepReport& a, const StepReport& b) { return metric(a) > metric(b); });
+            if (sorted.size() > 10) sorted.resize(10);
+            std::string top = "    \"" + std::string{key} + "\": [";
+            for (size_t i = 0; i < sorted.size(); i++) {
+                top += i == 0 ? "\n" : ",\n";
+                top += "      {\"step\":\"" + escapeStringJSON(sorted[i].step->opts.name) + "\"," + renderUsage(sorted[i].wall_us, sorted[i].usage) + "}";
+            }
+            return top + "\n    ]";
+        };
+        res += "  \"top\": {\n";
+        res += renderTop("wall", [](const StepReport& r) { return r.wall_us; }) + ",\n";
+        res += renderTop("cpu", [](const StepReport& r) { return r.usage.user_us + r.usage.sys_us; }) + ",\n";
+        res += renderTop("peak_rss", [](const StepReport& r) { return r.usage.peak_rss_kb; }) + ",\n";
+        res += renderTop("io", [](const StepReport& r) { return r.usage.read_bytes + r.usage.write_bytes; }) + "\n";
+        res += "  }\n";
+        res += "}\n";
+
+        std::filesystem::create_directories(out.parent_path());
+        writeEntireFile(out, res);
+    }
+
     void parseArgs() {
         // baked options
         options["compiler"] = Option{.key = "compiler", .description = "Set C++ compiler to use by default"};
@@ -1436,6 +4634,34 @@ private:
         options["debug-info"] = Option{.key = "debug-info", .description = "Generate debug info (default: enabled)"};
         options["lto"] = Option{.key = "lto", .description = "Enable Link Time Optimization (default: disabled)"};
 
+        parseCliArgs();
+
+        auto optimize_opt = option<std::string>("optimize").value_or("default");
+        if (optimize_opt == "default") global_flags.optimize = Optimize::Default;
+        if (optimize_opt == "O0") global_flags.optimize = Optimize::O0;
+        if (optimize_opt == "O1") global_flags.optimize = Optimize::O1;
+        if (optimize_opt == "O2") global_flags.optimize = Optimize::O2;
+        if (optimize_opt == "O3") global_flags.optimize = Optimize::O3;
+        if (optimize_opt == "Fast") global_flags.optimize = Optimize::Fast;
+
+        auto standard_opt = option<std::string>("cxx-standard").value_or("default");
+        if (standard_opt == "default") global_flags.standard = CXXStandard::Default;
+        if (standard_opt == "c++11") global_flags.standard = CXXStandard::CXX11;
+        if (standard_opt == "c++14") global_flags.standard = CXXStandard::CXX14;
+        if (standard_opt == "c++17") global_flags.standard = CXXStandard::CXX17;
+        if (standard_opt == "c++20") global_flags.standard = CXXStandard::CXX20;
+        if (standard_opt == "c++23") global_flags.standard = CXXStandard::CXX23;
+
+        global_lib_exe_flags.asan = option<bool>("asan").value_or(false);
+        global_lib_exe_flags.debug_info = option<bool>("debug-info").value_or(true);
+        global_lib_exe_flags.lto = option<bool>("lto").value_or(false);
+
+        auto compiler_opt = option<std::string>("compiler");
+        if (compiler_opt.has_value()) global_flags.compile_driver = *compiler_opt;
+    }
+
+    // only fills state directly controlled by command line, options are not applied here
+    void parseCliArgs() {
         auto argc = saved_argc;
         auto argv = saved_argv.data();
         for (int i = 1; i < argc; ++i) {
@@ -1499,35 +4725,51 @@ private:
                 continue;
             }
 
-            // steps to execute sequentially
-            requested_steps.push_back(arg);
-        }
+            if (arg == "--server") {
+                server_mode = true;
+                continue;
+            }
 
-        auto optimize_opt = option<std::string>("optimize").value_or("default");
-        if (optimize_opt == "default") global_flags.optimize = Optimize::Default;
-        if (optimize_opt == "O0") global_flags.optimize = Optimize::O0;
-        if (optimize_opt == "O1") global_flags.optimize = Optimize::O1;
-        if (optimize_opt == "O2") global_flags.optimize = Optimize::O2;
-        if (optimize_opt == "O3") global_flags.optimize = Optimize::O3;
-        if (optimize_opt == "Fast") global_flags.optimize = Optimize::Fast;
+            if (arg == "--no-server") { // handled by forwardToServer
+                continue;
+            }
 
-        auto standard_opt = option<std::string>("cxx-standard").value_or("default");
-        if (standard_opt == "default") global_flags.standard = CXXStandard::Default;
-        if (standard_opt == "c++11") global_flags.standard = CXXStandard::CXX11;
-        if (standard_opt == "c++14") global_flags.standard = CXXStandard::CXX14;
-        if (standard_opt == "c++17") global_flags.standard = CXXStandard::CXX17;
-        if (standard_opt == "c++20") global_flags.standard = CXXStandard::CXX20;
-        if (standard_opt == "c++23") global_flags.standard = CXXStandard::CXX23;
+            if (arg == "--watch") {
+                watch_mode = true;
+                continue;
+            }
 
-        global_lib_exe_flags.asan = option<bool>("asan").value_or(false);
-        global_lib_exe_flags.debug_info = option<bool>("debug-info").value_or(true);
-        global_lib_exe_flags.lto = option<bool>("lto").value_or(false);
+            if (arg.rfind("--events=", 0) == 0) {
+                events_spec = arg.substr(9);
+                continue;
+            }
 
-        auto compiler_opt = option<std::string>("compiler");
-        if (compiler_opt.has_value()) global_flags.compile_driver = *compiler_opt;
+            if (arg == "--explain") {
+                explain = true;
+                continue;
+            }
+
+            if (arg == "--time-trace") {
+                time_trace = true;
+                continue;
+            }
+
+            if (arg == "--io-uring") {
+                runtime()->io_uring = true;
+                continue;
+            }
 
-        if (max_parallel_jobs <= 0) max_parallel_jobs = std::thread::hardware_concurrency();
-        if (requested_steps.empty()) report_help = true;
+            if (arg.rfind("--report=", 0) == 0) {
+                report_path = std::filesystem::absolute(arg.substr(9));
+                continue;
+            }
+
+            // steps to execute sequentially
+            requested_steps.push_back(arg);
+        }
+
+        if (max_parallel_jobs <= 0) max_parallel_jobs = defaultJobCount();
+        if (requested_steps.empty() && !server_mode) report_help = true;
     }
 
     void parseOldOptions() {
@@ -1552,33 +4794,210 @@ private:
         options_file.close();
     }
 
-    [[nodiscard]] Hash buildEntireSourceFileHashCached(ObjOpts obj, Path source_file) {
-        // scan deps using compiler on source_file
+    // key of depfile cache entry, scan itself is done by buildEntireSourceFileHashCached
+    Hash depScanHash(ObjOpts obj, Path source_file, std::string* out_cmd = nullptr) {
         auto cmd = std::string{};
         cmdRenderCompileObj(&cmd, obj, {source_file}, {}, "{out}");
         cmd += " -M";
-        auto inputs_h = hashString(cmd).combine(hashFile(source_file));
+        auto h = hashString(cmd).combine(hashFile(source_file));
+        if (out_cmd) *out_cmd = cmd;
+        return h;
+    }
+
+    static bool isCSourceOrHeader(const Path& path) {
+        static const std::unordered_set<std::string> exts = {
+            "", ".c", ".cc", ".cpp", ".cxx", ".c++", ".cppm", ".ixx", ".h", ".hh", ".hpp", ".hxx", ".h++", ".inl", ".ipp", ".tcc", ".inc",
+        };
+        return exts.count(path.extension().string()) > 0;
+    }
+
+    // hash of source or header in keys of objs, see SourceHashing. other files are always hashed by bytes
+    Hash sourceHash(const Path& path) {
+        auto bytes_h = hashFile(path);
+        if (source_hashing == SourceHashing::Bytes || !isCSourceOrHeader(path)) return bytes_h;
+        bool keep_lines = source_hashing == SourceHashing::Tokens;
+        auto& hashes = token_hashes[keep_lines];
+        {
+            std::lock_guard lock{token_hashes_mutex};
+            if (!token_hashes_loaded) loadTokenHashes();
+            auto it = hashes.find(bytes_h.value);
+            if (it != hashes.end()) {
+                it->second.used = true;
+                return Hash{it->second.hash};
+            }
+        }
+        // file may have changed since it was hashed, so tokens are stored under hash of bytes they were lexed from
+        auto src = readEntireFile(path);
+        auto read_h = hashBytes(Hash{}, src.data(), src.size());
+        auto tokens = normalizeSourceTokens(src, keep_lines);
+        auto token_h = hashString(keep_lines ? "tokens" : "tokens ignoring lines").combine(hashBytes(Hash{}, tokens.data(), tokens.size()));
+        std::lock_guard lock{token_hashes_mutex};
+        hashes[read_h.value] = {token_h.value, true};
+        token_hashes_dirty = true;
+        return token_h;
+    }
+
+    void loadTokenHashes() {
+        token_hashes_loaded = true;
+        std::ifstream fin{tokenHashesPath(), std::ios::binary};
+        std::string data{std::istreambuf_iterator<char>{fin}, {}};
+        CacheReader r{data};
+        if (data.empty() || r.u64() != token_hashes_version) return;
+        for (auto& hashes : token_hashes) {
+            auto count = r.u64();
+            for (uint64_t i = 0; i < count && r.ok; i++) {
+                auto bytes_h = r.u64();
+                auto token_h = r.u64();
+                if (r.ok) hashes[bytes_h] = {token_h, false};
+            }
+        }
+    }
+
+    // old contents of files pile up, so once there are many of them only the ones used by this run are kept
+    void saveTokenHashes() {
+        token_hashes_dirty = false;
+        bool prune = token_hashes[0].size() + token_hashes[1].size() > 64 * 1024;
+        CacheWriter w;
+        w.u64(token_hashes_version);
+        for (const auto& hashes : token_hashes) {
+            w.u64(std::count_if(hashes.begin(), hashes.end(), [&](const auto& it) { return it.second.used || !prune; }));
+            for (const auto& [bytes_h, entry] : hashes) {
+                if (!entry.used && prune) continue;
+                w.u64(bytes_h);
+                w.u64(entry.hash);
+            }
+        }
+        auto tmp_path = newTmpPath();
+        std::ofstream fout{tmp_path, std::ios::binary};
+        fout.write(w.buf.data(), w.buf.size());
+        fout.close();
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, tokenHashesPath(), ec);
+    }
+
+    bool objHasDebugInfo(const ObjOpts& obj) {
+        auto flags = applyFlagsOverlay(global_flags, &obj.flags);
+        if (obj.opt_whole && obj.opt_whole->debug_info.value_or(global_lib_exe_flags.debug_info)) return true;
+        return (" " + flags.extra_flags).find(" -g") != std::string::npos;
+    }
+
+    // key of obj made of its preprocessed source and flags left after preprocessing. line markers are dropped, or made
+    // relative to root when obj has debug info, which then also depends on root like debug info does.
+    // preprocessing runs only when direct key (command, source and headers from depfile) was not seen before, after that
+    // manifest stored in cache under direct key maps it to preprocessed key
+    Hash preprocessedObjKey(const ObjOpts& obj, Hash direct_h) {
+        auto manifest_h = hashString("preprocessed obj key").combine(direct_h);
+        if (cacheEntryExists(manifest_h)) {
+            auto key_h = Hash{std::stoull(readEntireFile(cacheEntryGetPath(manifest_h)))};
+            explainKeyItem("preprocessed source", "", key_h);
+            return key_h;
+        }
 
+        auto cmd = std::string{};
+        auto out = newTmpPath();
+        cmdRenderCompileObj(&cmd, obj, {obj.source}, {}, out);
+        cmd += " -E";
+        {
+            JobToken token{this};
+            auto ret = runCmd(cmd);
+            if (ret != 0) panic("Failed to preprocess source file \"%s\"\n    using cmd \"%s\"\n", obj.source.c_str(), cmd.c_str());
+        }
+        auto preprocessed = readEntireFile(out);
+        std::error_code ec;
+        std::filesystem::remove(out, ec);
+
+        bool debug_info = objHasDebugInfo(obj);
+        auto root_prefix = root.string() + "/";
+        Hash pp_h{};
+        size_t pos = 0;
+        while (pos < preprocessed.size()) {
+            auto end = preprocessed.find('\n', pos);
+            end = end == std::string::npos ? preprocessed.size() : end + 1;
+            auto line = std::string_view{preprocessed}.substr(pos, end - pos);
+            pos = end;
+            bool marker = line.size() > 2 && line[0] == '#' && line[1] == ' ' && std::isdigit(static_cast<unsigned char>(line[2]));
+            if (marker && !debug_info) continue;
+            if (marker) {
+                auto quote = line.find('"');
+                if (quote != std::string_view::npos && line.substr(quote + 1, root_prefix.size()) == root_prefix) {
+                    auto rel = std::string{line.substr(0, quote + 1)} + std::string{line.substr(quote + 1 + root_prefix.size())};
+                    pp_h = hashBytes(pp_h, rel.data(), rel.size());
+                    continue;
+                }
+            }
+            pp_h = hashBytes(pp_h, line.data(), line.size());
+        }
+
+        auto flags = applyFlagsOverlay(global_flags, &obj.flags);
+        auto key_h = hashString("preprocessed").combine(pp_h);
+        key_h = key_h.combine(hashString(flags.compile_driver.string()));
+        key_h = key_h.combine(hashString(flags.extra_flags));
+        key_h = key_h.combine(Hash{static_cast<uint64_t>(flags.optimize)});
+        key_h = key_h.combine(Hash{static_cast<uint64_t>(flags.warnings)}); // -w changes outcome with -Werror in extra flags
+        key_h = key_h.combine(Hash{static_cast<uint64_t>(flags.standard)});
+        key_h = key_h.combine(hashWholeObjOpts(obj.opt_whole));
+        if (debug_info) key_h = key_h.combine(hashString(root.string()));
+        explainKeyItem("preprocessed source", "", key_h);
+
+        auto manifest = newTmpPath();
+        writeEntireFile(manifest, std::to_string(key_h.value));
+        cacheEntryMoveFromTmp(manifest_h, manifest);
+        return key_h;
+    }
+
+    // runs dependency scan of source unless it is cached, returns its cache entry
+    Hash depScan(ObjOpts obj, Path source_file) {
+        auto cmd = std::string{};
+        auto inputs_h = depScanHash(obj, source_file, &cmd);
         if (!cacheEntryExists(inputs_h)) {
+            auto compiler = compilerInfo(applyFlagsOverlay(global_flags, &obj.flags).compile_driver);
             auto out = newTmpPath();
             commandReplacePatternIfExist(&cmd, "{out}", {out});
-            auto ret = std::system(cmd.data());
+            JobToken token{this};
+            auto ret = runCmd(cmd);
             if (ret != 0) panic("Failed to scan source file dependencies for file \"%s\"\n    using cmd \"%s\"\n", source_file.c_str(), cmd.c_str());
+            // headers of compiler are keyed by its identity, so they are not stored at all
+            std::string filtered = "deps:";
+            for (const auto& dep : parseDepfile(out, false)) {
+                if (isSystemHeader(compiler, dep)) continue;
+                filtered += " \\\n ";
+                for (char c : dep.string()) filtered += c == ' ' ? std::string{"\\ "} : std::string{c};
+            }
+            writeEntireFile(out, filtered + "\n");
             cacheEntryMoveFromTmp(inputs_h, out);
         }
+        return inputs_h;
+    }
+
+    [[nodiscard]] Hash buildEntireSourceFileHashCached(ObjOpts obj, Path source_file, std::vector<Path>* out_deps = nullptr) {
+        // scan deps using compiler on source_file
+        auto inputs_h = depScan(obj, source_file);
+        // scan itself needs real paths, but key of obj must stay the same when only location of generated files changed
+        auto key_cmd = std::string{};
+        cmdRenderCompileObj(&key_cmd, obj, {obj.generated_source ? Path{objSourceKey(obj)} : source_file}, {}, "{out}", true);
+        auto key_h = hashString(key_cmd).combine(sourceHash(source_file));
+        explainKeyItem("dependency scan command", "", hashString(key_cmd));
+        auto driver = applyFlagsOverlay(global_flags, &obj.flags).compile_driver;
+        auto compiler = compilerInfo(driver);
+        key_h = key_h.combine(compiler.identity);
+        explainKeyItem("compiler", driver.string(), compiler.identity);
 
         auto deps = parseDepfile(cacheEntryGetPath(inputs_h));
         Hash deps_h{};
         for (auto dep : deps) {
-            deps_h = deps_h.combine(hashFile(dep));
+            if (isSystemHeader(compiler, dep)) continue; // depfile scanned by older version
+            deps_h = deps_h.combine(sourceHash(dep));
+            explainKeyItem("file", obj.generated_source && dep == source_file ? objSourceKey(obj) : dep.string(), sourceHash(dep));
         }
-        return inputs_h.combine(deps_h);
+        if (out_deps) *out_deps = deps;
+        return key_h.combine(deps_h);
     }
 
-    void recompileSelf(Hash new_self_hash, const char* reason) {
+    void recompileSelf(Hash new_self_hash, Hash header_hash, const char* reason) {
         Colorizer c{stdout};
         // first things first, save hash
         writeEntireFile(selfHashPath(), std::to_string(new_self_hash.value));
+        writeEntireFile(selfHeaderHashPath(), std::to_string(header_hash.value));
         auto start = Clock::now();
         auto compile = std::string{};
         compile += BPP_RECOMPILE_SELF_CMD;
@@ -1591,6 +5010,7 @@ private:
             // remove hash file to avoid infinite recompilation loop
             std::error_code ec;
             std::filesystem::remove(selfHashPath(), ec);
+            std::filesystem::remove(selfHeaderHashPath(), ec);
             panic("Failed to recompile build tool\n");
         }
         // move cursor up one line to overwrite the recompilation message
@@ -1602,9 +5022,44 @@ private:
         // if execv returns, it failed 
         std::error_code ec;
         std::filesystem::remove(selfHashPath(), ec);
+        std::filesystem::remove(selfHeaderHashPath(), ec);
         panic("Failed to exec recompiled build tool\n");
     }
 
+    // compiles build script into shared library, cached by hash of script and everything it includes
+    Path compileBuildScriptPlugin(Hash hash, Path src, std::string what) {
+        if (!cacheEntryExists(hash)) {
+            Colorizer c{stdout};
+            auto start = Clock::now();
+            blog("%s[*] Compiling %s...%s\n", c.yellow(), what.c_str(), c.reset());
+            auto tmp_path = newTmpPath();
+            std::string cmd;
+            cmd += BPP_RECOMPILE_SELF_CMD;
+            cmd += " -shared -fPIC";
+            cmd += " -o \"" + tmp_path.string() + "\"";
+            cmd += " \"" + src.string() + "\"";
+            if (verbose) blog("Build script compile cmd: %s\n", cmd.c_str());
+            int res = std::system(cmd.c_str());
+            if (res != 0) panic("Failed to compile %s\n", what.c_str());
+            cacheEntryMoveFromTmp(hash, tmp_path);
+            auto end = Clock::now();
+            blog("%s%s[+] Compiled %s in %.2fs%s\n", c.discard_prev_line(), c.gray(), what.c_str(), std::chrono::duration<double>(end - start).count(), c.reset());
+        }
+        return cacheEntryGetPath(hash);
+    }
+
+    // load library, let it live forever. closures created by its configure() point into it
+    ConfigureFn loadConfigureStable(Path lib, void** handle) {
+        *handle = dlopen(lib.c_str(), RTLD_LAZY | RTLD_LOCAL);
+        if (!*handle) panic("Failed to dlopen build script library %s: %s\n", lib.c_str(), dlerror());
+        using AttachF = void (*)(Runtime*);
+        auto attach_fn = (AttachF)dlsym(*handle, "bpp_attach_runtime");
+        if (attach_fn) attach_fn(runtime());
+        auto configure_fn = (ConfigureFn)dlsym(*handle, "configure_stable");
+        if (!configure_fn) panic("Failed to find symbol \"configure_stable\" in build script library %s: %s\n", lib.c_str(), dlerror());
+        return configure_fn;
+    }
+
     void performStepIfNeeded(Step* step) {
         if (step->threadSafeIsCompleted()) {
             return;
@@ -1622,17 +5077,23 @@ private:
 
         // recalc hash
         Hash h{0};
+        std::vector<KeyItem> key_items;
         for (auto* dep : step->deps) {
             if (!dep->hash.has_value()) panic("Dependency step hash not computed before dependant");
             h = h.combineUnordered(*dep->hash);
+            key_items.push_back({"dependency", dep->opts.name, dep->hash->value});
         }
         for (auto dep : step->inputs) {
             if (dep.step == nullptr) { continue; }
             if (!dep.step->hash.has_value()) panic("Dependency (input) step hash not computed before dependant");
-            h = h.combineUnordered(*dep.step->hash);
+            auto dep_h = inputKey(dep);
+            h = h.combineUnordered(dep_h);
+            key_items.push_back({"dependency", lazyPathKey(dep), dep_h.value});
         }
         if (step->inputs_hash) {
+            beginKeyItems();
             h = step->inputs_hash(h);
+            endKeyItems(h, &key_items);
         }
         step->hash = h;
         auto expected_path = cacheEntryOfStep(step);
@@ -1645,6 +5106,8 @@ private:
                 if (!step->opts.silent) {
                     if (verbose) blog("%s[step]%s %s%s%s up-to-date!\n", c.gray(), c.reset(), c.yellow(), step->opts.name.c_str(), c.reset());
                 }
+                progressStepChecked(step, true);
+                emitStepEvent("cache", step, ",\"hit\":true,\"hash\":\"" + std::to_string(step->hash->value) + "\"");
                 step->markCompleted();
                 return;
             } else {
@@ -1655,21 +5118,276 @@ private:
         }
 
         // perform this step
+        progressStepChecked(step, false);
+        if (!step->opts.phony) explainStep(step, key_items);
+        if (!step->opts.phony) emitStepEvent("cache", step, ",\"hit\":false,\"hash\":\"" + std::to_string(step->hash->value) + "\"");
+        auto action_start = Clock::now();
         if (step->action) {
             // if action produces output file, use tmp file and then rename to avoid
             auto tmp_path = newTmpPath();
+            MemoryAdmission admission{this, step};
+            JobToken token{this, poolOf(step).takes_job_slot};
+            auto* rt = runtime();
+            {
+                std::lock_guard<std::mutex> lock(rt->usage_mutex);
+                rt->thread_usage[std::this_thread::get_id()] = {};
+            }
+            auto start = Clock::now();
             step->action(tmp_path);
+            auto end = Clock::now();
+            StepReport report{.step = step, .wall_us = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(end - start).count())};
+            {
+                std::lock_guard<std::mutex> lock(rt->usage_mutex);
+                report.usage = rt->thread_usage[std::this_thread::get_id()];
+                rt->thread_usage.erase(std::this_thread::get_id());
+            }
+            {
+                std::lock_guard<std::mutex> lock(admission_mutex);
+                step_history_updates[step->unique_name] = StepHistory{.peak_rss_kb = report.usage.peak_rss_kb, .duration_ms = report.wall_us / 1000};
+                step_reports.push_back(report);
+            }
+            for (const auto& name : step->opts.outputs) {
+                if (!std::filesystem::exists(tmp_path / name)) panic("Step %s did not create its declared output \"%s\"\n", step->opts.name.c_str(), name.c_str());
+            }
             if (std::filesystem::exists(tmp_path)) {
                 std::error_code ec;
                 std::filesystem::rename(tmp_path, expected_path, ec);
                 if (ec) panic("Failed to rename tmp file %s to %s: %s\n", tmp_path.c_str(), expected_path.c_str(), ec.message().c_str());
             }
         }
+        if (!step->opts.phony) recordKey(step, std::move(key_items), std::filesystem::exists(expected_path));
 
-        if (!step->opts.silent) blog("%s[step]%s %s%s%s completed\n", c.gray(), c.reset(), c.yellow(), step->opts.name.c_str(), c.reset());
+        if (!step->opts.silent && !progress.enabled) blog("%s[step]%s %s%s%s completed\n", c.gray(), c.reset(), c.yellow(), step->opts.name.c_str(), c.reset());
+        progressStepDone(step);
+        auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - action_start).count();
+        emitStepEvent("finished", step, ",\"duration_ms\":" + std::to_string(duration_ms) + ",\"exit_code\":0");
         step->markCompleted();
     }
 
+    // events go to --events destination as json lines. every thread collects them in its own buffer and writes
+    // whole lines with single write(2), so workers do not serialize on print_mutex
+    void openEvents(size_t steps_count) {
+        if (events_spec.empty()) return;
+        if (events_spec.rfind("fd:", 0) == 0) {
+            events_fd = std::atoi(events_spec.c_str() + 3);
+            if (fcntl(events_fd, F_GETFD) < 0) panic("Events fd %d is not open\n", events_fd);
+            events_fd_owned = false;
+        } else {
+            events_fd = ::open(events_spec.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            if (events_fd < 0) panic("Failed to open events file %s: %s\n", events_spec.c_str(), strerror(errno));
+            events_fd_owned = true;
+        }
+        events_start = Clock::now();
+        events_build = this;
+        static bool exit_hook_installed = false;
+        if (!exit_hook_installed) {
+            exit_hook_installed = true;
+            std::atexit([]() { // build failed, panic() called exit() in thread of failed step
+                if (events_build) events_build->emitFailureEvents();
+            });
+        }
+        emitEvent("\"event\":\"build_start\",\"steps\":" + std::to_string(steps_count) + ",\"jobs\":" + std::to_string(max_parallel_jobs));
+    }
+
+    void closeEvents() {
+        if (events_fd < 0) return;
+        emitSummaryEvent(true);
+        events_build = nullptr;
+        if (events_fd_owned) ::close(events_fd);
+        events_fd = -1;
+    }
+
+    void emitFailureEvents() {
+        Step* failed = nullptr;
+        Clock::time_point started;
+        {
+            std::lock_guard<std::mutex> lock(progress.mutex);
+            if (auto it = progress.thread_steps.find(std::this_thread::get_id()); it != progress.thread_steps.end()) {
+                failed = it->second;
+                started = progress.running[failed].first;
+            }
+        }
+        if (failed) {
+            int exit_code = 1;
+            auto* rt = runtime();
+            {
+                std::lock_guard<std::mutex> lock(rt->usage_mutex);
+                if (auto it = rt->thread_usage.find(std::this_thread::get_id()); it != rt->thread_usage.end() && it->second.exit_code != 0) exit_code = it->second.exit_code;
+            }
+            auto now = Clock::now();
+            writeEvents("{\"t_ms\":" + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now - events_start).count())
+                + ",\"event\":\"finished\",\"step\":\"" + escapeStringJSON(failed->opts.name) + "\""
+                + ",\"duration_ms\":" + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(now - started).count())
+                + ",\"exit_code\":" + std::to_string(exit_code) + "}\n");
+        }
+        emitSummaryEvent(false);
+    }
+
+    // written directly, at exit buffer of thread may be already destroyed
+    void emitSummaryEvent(bool success) {
+        std::lock_guard<std::mutex> lock(progress.mutex);
+        auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - events_start).count();
+        writeEvents("{\"t_ms\":" + std::to_string(duration_ms) + ",\"event\":\"summary\",\"success\":" + std::string{success ? "true" : "false"}
+            + ",\"steps\":" + std::to_string(progress.total)
+            + ",\"finished\":" + std::to_string(progress.finished)
+            + ",\"cache_hits\":" + std::to_string(progress.cache_hits)
+            + ",\"cache_misses\":" + std::to_string(progress.cache_misses)
+            + ",\"duration_ms\":" + std::to_string(duration_ms) + "}\n");
+    }
+
+    void emitStepEvent(const char* event, Step* step, const std::string& fields, bool flush = true) {
+        if (events_fd < 0) return;
+        emitEvent("\"event\":\"" + std::string{event} + "\",\"step\":\"" + escapeStringJSON(step->opts.name) + "\"" + fields, flush);
+    }
+
+    static std::string& threadEventsBuffer() {
+        static thread_local std::string buffer;
+        return buffer;
+    }
+
+    void emitEvent(const std::string& fields, bool flush = true) {
+        if (events_fd < 0) return;
+        auto t_ms = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - events_start).count();
+        threadEventsBuffer() += "{\"t_ms\":" + std::to_string(t_ms) + "," + fields + "}\n";
+        if (flush) flushEvents();
+    }
+
+    void flushEvents() {
+        auto& buffer = threadEventsBuffer();
+        if (events_fd < 0 || buffer.empty()) return;
+        writeEvents(buffer);
+        buffer.clear();
+    }
+
+    // writes up to PIPE_BUF are not interleaved with writes of other threads, so chunks are cut at line ends
+    void writeEvents(const std::string& buffer) {
+        size_t pos = 0;
+        while (pos < buffer.size()) {
+            size_t len = buffer.size() - pos;
+            if (len > PIPE_BUF) {
+                auto line_end = buffer.rfind('\n', pos + PIPE_BUF - 1);
+                len = line_end != std::string::npos && line_end >= pos ? line_end + 1 - pos : len;
+            }
+            auto n = ::write(events_fd, buffer.data() + pos, len);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break; // consumer is gone, build goes on
+            pos += n;
+        }
+    }
+
+    uint64_t expectedDurationUs(Step* step) {
+        auto it = step_history.find(step->unique_name);
+        if (it == step_history.end()) return progress.default_expected_us;
+        return it->second.duration_ms * 1000;
+    }
+
+    void progressStart(const std::vector<Step*>& steps_run_order) {
+        std::lock_guard<std::mutex> lock(progress.mutex);
+        progress.enabled = !verbose && !silent && isatty(STDOUT_FILENO);
+        progress.total = progress.unchecked = steps_run_order.size();
+        progress.finished = progress.cache_hits = progress.cache_misses = 0;
+        progress.running.clear();
+        progress.thread_steps.clear();
+        progress.start = Clock::now();
+        uint64_t history_total_ms = 0;
+        for (const auto& [name, entry] : step_history) history_total_ms += entry.duration_ms;
+        progress.default_expected_us = step_history.empty() ? 0 : history_total_ms * 1000 / step_history.size();
+        progress.unchecked_expected_us = 0;
+        for (auto* step : steps_run_order) progress.unchecked_expected_us += expectedDurationUs(step);
+        runtime()->capture_output = progress.enabled;
+    }
+
+    void progressStepsAdded(const std::vector<Step*>& steps) {
+        std::lock_guard<std::mutex> lock(progress.mutex);
+        progress.total += steps.size();
+        progress.unchecked += steps.size();
+        for (auto* step : steps) progress.unchecked_expected_us += expectedDurationUs(step);
+    }
+
+    void progressStop() {
+        {
+            std::lock_guard<std::mutex> lock(progress.mutex);
+            if (!progress.enabled) return;
+            progress.enabled = false;
+        }
+        runtime()->capture_output = false;
+        showProgressLine("");
+        Colorizer c{stdout};
+        blog("%s[+]%s %zu steps done (%zu up-to-date) in %.2fs\n", c.gray(), c.reset(), progress.finished, progress.cache_hits, std::chrono::duration<double>(Clock::now() - progress.start).count());
+    }
+
+    // hit means step artifact is found in cache and step will not be performed
+    void progressStepChecked(Step* step, bool hit) {
+        {
+            std::lock_guard<std::mutex> lock(progress.mutex);
+            auto expected = expectedDurationUs(step);
+            progress.unchecked--;
+            progress.unchecked_expected_us -= std::min(progress.unchecked_expected_us, expected);
+            if (hit) {
+                progress.cache_hits++;
+                progress.finished++;
+            } else {
+                if (!step->opts.phony) progress.cache_misses++;
+                progress.running[step] = {Clock::now(), expected};
+                progress.thread_steps[std::this_thread::get_id()] = step;
+            }
+        }
+        progressDraw(false);
+    }
+
+    void progressStepDone(Step* step) {
+        {
+            std::lock_guard<std::mutex> lock(progress.mutex);
+            progress.running.erase(step);
+            progress.thread_steps.erase(std::this_thread::get_id());
+            progress.finished++;
+        }
+        progressDraw(false);
+    }
+
+    void progressDraw(bool force) {
+        std::string line;
+        {
+            std::lock_guard<std::mutex> lock(progress.mutex);
+            if (!progress.enabled) return;
+            auto now = Clock::now();
+            if (!force && now - progress.last_draw < std::chrono::milliseconds(100)) return;
+            progress.last_draw = now;
+
+            // work left: rest of running steps, plus unchecked ones that miss cache as often as checked ones did
+            uint64_t left_us = 0;
+            Step* longest = nullptr;
+            Clock::time_point longest_start = now;
+            for (const auto& [step, run] : progress.running) {
+                auto elapsed = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(now - run.first).count());
+                left_us += run.second > elapsed ? run.second - elapsed : 0;
+                if (run.first <= longest_start) {
+                    longest = step;
+                    longest_start = run.first;
+                }
+            }
+            auto checked = progress.cache_hits + progress.cache_misses;
+            double miss_ratio = checked > 0 ? static_cast<double>(progress.cache_misses) / checked : 1.0;
+            left_us += static_cast<uint64_t>(progress.unchecked_expected_us * miss_ratio);
+            auto eta_s = left_us / 1000000 / std::max(max_parallel_jobs, 1);
+
+            Colorizer c{stdout};
+            char buf[256];
+            std::snprintf(buf, sizeof(buf), "[%zu/%zu] %zu running, %d%% cached, ETA %s",
+                progress.finished, progress.total, progress.running.size(),
+                checked > 0 ? static_cast<int>(progress.cache_hits * 100 / checked) : 0,
+                progress.default_expected_us == 0 && progress.unchecked > 0 ? "?" : (eta_s >= 60 ? std::to_string(eta_s / 60) + "m" + std::to_string(eta_s % 60) + "s" : std::to_string(eta_s) + "s").c_str());
+            line = buf;
+            if (longest) line += " " + longest->opts.name;
+
+            // wrapped line can't be discarded with one line up
+            winsize ws = {};
+            if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 1 && line.size() >= ws.ws_col) line.resize(ws.ws_col - 1);
+            line = std::string{c.gray()} + line + c.reset();
+        }
+        showProgressLine(line);
+    }
+
     // entry may be a file or a directory
     Path cacheEntryOfStep(Step* step) {
         auto res = cache / "arts" / std::to_string(step->hash->value);
@@ -1678,7 +5396,12 @@ private:
         return res;
     }
 
-    std::vector<Path> parseDepfile(Path depfile) {
+    std::vector<Path> parseDepfile(Path depfile, bool cached = true) {
+        auto* rt = runtime();
+        if (cached) {
+            std::lock_guard<std::mutex> lock(rt->depfile_mutex);
+            if (auto it = rt->depfile_cache.find(depfile); it != rt->depfile_cache.end()) return it->second;
+        }
         std::ifstream fin{depfile};
         if (!fin.is_open()) panic("Failed to open depfile %s for reading\n", depfile.c_str());
         // skip until ": "
@@ -1711,6 +5434,9 @@ private:
             file += c;
         }
         if (!file.empty()) dep_files.push_back(Path{file});
+        if (!cached) return dep_files;
+        std::lock_guard<std::mutex> lock(rt->depfile_mutex);
+        rt->depfile_cache[depfile] = dep_files;
         return dep_files;
     }
 
@@ -1735,10 +5461,845 @@ private:
         return cache / "bpp.hash";
     }
 
+    std::filesystem::path selfHeaderHashPath() {
+        return cache / "bpp.header.hash";
+    }
+
+    std::filesystem::path graphSnapshotPath() {
+        return cache / "bpp.graph";
+    }
+
     std::filesystem::path selfOptionsPath() {
         return cache / "bpp.options";
     }
 
+    std::filesystem::path stepHistoryPath() {
+        return cache / "bpp.history";
+    }
+
+    std::filesystem::path compilerRecordsPath() {
+        return cache / "bpp.compilers";
+    }
+
+    std::filesystem::path dirListingsPath() {
+        return cache / "bpp.dirs";
+    }
+
+    std::filesystem::path tokenHashesPath() {
+        return cache / "bpp.tokens";
+    }
+
+    std::filesystem::path keyRecordsPath() {
+        return cache / "bpp.explain";
+    }
+
+    // items are collected per thread, because inputs_hash of step may be called from build script plugin
+    void beginKeyItems() {
+        auto* rt = runtime();
+        std::lock_guard<std::mutex> lock(rt->explain_mutex);
+        rt->explain_items[std::this_thread::get_id()].clear();
+    }
+
+    void endKeyItems(Hash inputs_h, std::vector<KeyItem>* items) {
+        auto* rt = runtime();
+        size_t deps_count = items->size();
+        {
+            std::lock_guard<std::mutex> lock(rt->explain_mutex);
+            auto& recorded = rt->explain_items[std::this_thread::get_id()];
+            for (auto& item : recorded) items->push_back(std::move(item));
+            rt->explain_items.erase(std::this_thread::get_id());
+        }
+        // custom inputs_hash does not tell what it consists of, record what it returned as a whole
+        if (items->size() == deps_count) items->push_back({"inputs", "", inputs_h.value});
+    }
+
+    std::string describeKeyItem(const KeyItem& item) {
+        if (item.what.empty()) return item.kind;
+        auto what = item.what;
+        if (item.kind == "file" || item.kind == "dir" || item.kind.find("path") != std::string::npos) {
+            auto rel = Path{what}.lexically_relative(root);
+            if (!rel.empty() && *rel.begin() != "..") what = rel.string();
+            if (item.kind == "file") return what; // "include/config.h changed" reads best
+        }
+        return item.kind + " " + what;
+    }
+
+    // tells why step is performed, comparing its key items with ones recorded when it was last performed
+    void explainStep(Step* step, const std::vector<KeyItem>& items) {
+        if (explain) {
+            std::vector<std::string> reasons;
+            auto prev_it = key_records.find(step->unique_name);
+            if (prev_it == key_records.end()) {
+                reasons.push_back("it was not built before");
+            } else {
+                std::unordered_map<std::string, uint64_t> prev, cur;
+                for (const auto& item : prev_it->second.items) prev[item.kind + '\0' + item.what] = item.hash;
+                for (const auto& item : items) {
+                    auto id = item.kind + '\0' + item.what;
+                    if (!cur.emplace(id, item.hash).second) continue; // same file may be recorded twice, e.g. source
+                    auto it = prev.find(id);
+                    if (it == prev.end()) reasons.push_back(describeKeyItem(item) + " added");
+                    else if (it->second != item.hash) reasons.push_back(describeKeyItem(item) + " changed");
+                }
+                for (const auto& item : prev_it->second.items) {
+                    if (cur.count(item.kind + '\0' + item.what) == 0) reasons.push_back(describeKeyItem(item) + " removed");
+                    cur[item.kind + '\0' + item.what] = item.hash; // report once
+                }
+                if (reasons.empty()) {
+                    if (!prev_it->second.cached) return; // performed on every run, nothing to explain
+                    reasons.push_back("its key did not change, but no artifact is cached for it");
+                }
+            }
+
+            std::string because;
+            constexpr size_t max_reasons = 3;
+            for (size_t i = 0; i < reasons.size() && i < max_reasons; i++) because += (i ? ", " : "") + reasons[i];
+            if (reasons.size() > max_reasons) because += " and " + std::to_string(reasons.size() - max_reasons) + " more";
+            Colorizer c{stdout};
+            blog("%s[explain]%s rebuilt %s%s%s because %s\n", c.gray(), c.reset(), c.yellow(), step->opts.name.c_str(), c.reset(), because.c_str());
+        }
+    }
+
+    // key items of performed steps are recorded on every run, so --explain can tell what changed since step was last
+    // performed, even if that run was without --explain
+    void recordKey(Step* step, std::vector<KeyItem> items, bool cached) {
+        std::lock_guard<std::mutex> lock(key_records_mutex);
+        key_record_updates[step->unique_name] = KeyRecord{.items = std::move(items), .cached = cached};
+    }
+
+    void loadKeyRecords() {
+        key_records.clear();
+        std::ifstream fin{keyRecordsPath(), std::ios::binary};
+        std::string data{std::istreambuf_iterator<char>{fin}, {}};
+        CacheReader r{data};
+        if (data.empty() || r.u64() != key_records_version) return;
+        auto count = r.u64();
+        for (uint64_t i = 0; i < count && r.ok; i++) {
+            auto name = r.str();
+            KeyRecord record;
+            record.cached = r.u64() != 0;
+            auto items_count = r.u64();
+            for (uint64_t j = 0; j < items_count && r.ok; j++) {
+                KeyItem item;
+                item.kind = r.str();
+                item.what = r.str();
+                item.hash = r.u64();
+                record.items.push_back(std::move(item));
+            }
+            if (r.ok) key_records[name] = std::move(record);
+        }
+    }
+
+    // merged the same way as step history
+    void saveKeyRecords() {
+        if (key_record_updates.empty()) return;
+        auto updates = std::move(key_record_updates);
+        key_record_updates.clear();
+        loadKeyRecords();
+        for (auto& [name, record] : updates) key_records[name] = std::move(record);
+
+        CacheWriter w;
+        w.u64(key_records_version);
+        w.u64(key_records.size());
+        for (const auto& [name, record] : key_records) {
+            w.str(name);
+            w.u64(record.cached);
+            w.u64(record.items.size());
+            for (const auto& item : record.items) {
+                w.str(item.kind);
+                w.str(item.what);
+                w.u64(item.hash);
+            }
+        }
+        auto tmp_path = newTmpPath();
+        std::ofstream fout{tmp_path, std::ios::binary};
+        fout.write(w.buf.data(), w.buf.size());
+        fout.close();
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, keyRecordsPath(), ec);
+    }
+
+    void loadStepHistory() {
+        step_history.clear();
+        std::ifstream fin{stepHistoryPath(), std::ios::binary};
+        std::string data{std::istreambuf_iterator<char>{fin}, {}};
+        CacheReader r{data};
+        if (data.empty() || r.u64() != step_history_version) return;
+        auto count = r.u64();
+        for (uint64_t i = 0; i < count && r.ok; i++) {
+            auto name = r.str();
+            StepHistory entry;
+            entry.peak_rss_kb = r.u64();
+            entry.duration_ms = r.u64();
+            if (r.ok) step_history[name] = entry;
+        }
+    }
+
+    // other processes (parallel builds, forked server requests) may have updated history meanwhile, so only entries
+    // of steps performed by us are merged into what is on disk
+    void saveStepHistory() {
+        if (step_history_updates.empty()) return;
+        auto updates = std::move(step_history_updates);
+        step_history_updates.clear();
+        loadStepHistory();
+        for (const auto& [name, entry] : updates) step_history[name] = entry;
+
+        CacheWriter w;
+        w.u64(step_history_version);
+        w.u64(step_history.size());
+        for (const auto& [name, entry] : step_history) {
+            w.str(name);
+            w.u64(entry.peak_rss_kb);
+            w.u64(entry.duration_ms);
+        }
+        auto tmp_path = newTmpPath();
+        std::ofstream fout{tmp_path, std::ios::binary};
+        fout.write(w.buf.data(), w.buf.size());
+        fout.close();
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, stepHistoryPath(), ec);
+    }
+
+    static Hash hashGlob(const std::vector<Path>& files) {
+        Hash h{};
+        for (const auto& file : files) h = h.combine(hashString(file.string()));
+        return h;
+    }
+
+    std::vector<Path> globFiles(const std::string& pattern) {
+        if (!dir_listings_loaded) loadDirListings();
+        std::vector<std::string> parts;
+        for (const auto& part : Path{pattern}) {
+            if (part == "/") panic("Glob pattern %s must be relative to project root\n", pattern.c_str());
+            if (!part.empty() && part != ".") parts.push_back(part.string());
+        }
+        std::vector<Path> res;
+        if (!parts.empty()) globWalk("", parts, 0, &res);
+        std::sort(res.begin(), res.end());
+        res.erase(std::unique(res.begin(), res.end()), res.end()); // "**/**" may reach file twice
+        return res;
+    }
+
+    void globWalk(const Path& dir, const std::vector<std::string>& parts, size_t i, std::vector<Path>* res) {
+        const auto& part = parts[i];
+        bool last = i + 1 == parts.size();
+        if (part.find_first_of("*?[") == std::string::npos) { // literal component, parent is not listed
+            struct stat st = {};
+            if (last && ::stat((root / dir / part).c_str(), &st) == 0 && S_ISREG(st.st_mode)) res->push_back(dir / part);
+            if (!last) globWalk(dir / part, parts, i + 1, res);
+            return;
+        }
+        auto* listing = listDirCached(dir);
+        if (!listing) return;
+        auto skipped = [&](const std::string& name) { return root / dir / name == cache || root / dir / name == out; };
+        if (part == "**") {
+            if (!last) globWalk(dir, parts, i + 1, res); // matches no directories
+            for (const auto& [name, kind] : listing->entries) {
+                if (last && kind == EntryKind::File && name[0] != '.') res->push_back(dir / name);
+                if (kind == EntryKind::Dir && name[0] != '.' && !skipped(name)) globWalk(dir / name, parts, i, res);
+            }
+            return;
+        }
+        for (const auto& [name, kind] : listing->entries) {
+            if (fnmatch(part.c_str(), name.c_str(), FNM_PERIOD) != 0) continue;
+            if (last && kind == EntryKind::File) res->push_back(dir / name);
+            if (!last && kind == EntryKind::Dir && !skipped(name)) globWalk(dir / name, parts, i + 1, res);
+        }
+    }
+
+    // nullptr if dir does not exist
+    DirListing* listDirCached(const Path& dir) {
+        auto abs = root / dir;
+        struct stat st = {};
+        if (::stat(abs.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) return nullptr;
+        auto mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        auto& listing = dir_listings[dir.string()]; // references to elements survive rehash, pointer is kept by callers
+        listing.used = true;
+        if (listing.mtime_ns != 0 && listing.mtime_ns == mtime_ns) return &listing;
+
+        listing.entries.clear();
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator{abs, ec}) {
+            auto kind = EntryKind::Other;
+            if (entry.is_regular_file(ec)) kind = EntryKind::File;
+            else if (entry.is_directory(ec) && !entry.is_symlink(ec)) kind = EntryKind::Dir; // like listFiles, links to dirs are not followed
+            listing.entries.push_back({entry.path().filename().string(), kind});
+        }
+        if (ec) panic("Listing directory %s failed: %s\n", abs.c_str(), ec.message().c_str());
+        std::sort(listing.entries.begin(), listing.entries.end());
+        // entry added within timestamp granularity after directory was read would not change its mtime
+        auto now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        listing.mtime_ns = now_ns - mtime_ns > 2000000000 ? mtime_ns : 0;
+        dir_listings_dirty = true;
+        return &listing;
+    }
+
+    void loadDirListings() {
+        dir_listings_loaded = true;
+        std::ifstream fin{dirListingsPath(), std::ios::binary};
+        std::string data{std::istreambuf_iterator<char>{fin}, {}};
+        CacheReader r{data};
+        if (data.empty() || r.u64() != dir_listings_version) return;
+        auto count = r.u64();
+        for (uint64_t i = 0; i < count && r.ok; i++) {
+            auto dir = r.str();
+            DirListing listing;
+            listing.mtime_ns = static_cast<int64_t>(r.u64());
+            auto entries = r.u64();
+            for (uint64_t j = 0; j < entries && r.ok; j++) {
+                auto name = r.str();
+                listing.entries.push_back({name, static_cast<EntryKind>(r.u64())});
+            }
+            if (r.ok) dir_listings[dir] = std::move(listing);
+        }
+    }
+
+    void saveDirListings() {
+        dir_listings_dirty = false;
+        CacheWriter w;
+        w.u64(dir_listings_version);
+        w.u64(std::count_if(dir_listings.begin(), dir_listings.end(), [](const auto& it) { return it.second.used; }));
+        for (const auto& [dir, listing] : dir_listings) {
+            if (!listing.used) continue; // removed directory or one no longer globbed
+            w.str(dir);
+            w.u64(static_cast<uint64_t>(listing.mtime_ns));
+            w.u64(listing.entries.size());
+            for (const auto& [name, kind] : listing.entries) {
+                w.str(name);
+                w.u64(static_cast<uint64_t>(kind));
+            }
+        }
+        auto tmp_path = newTmpPath();
+        std::ofstream fout{tmp_path, std::ios::binary};
+        fout.write(w.buf.data(), w.buf.size());
+        fout.close();
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, dirListingsPath(), ec);
+    }
+
+    // cpus of our container, further limited by how many average steps fit into its memory
+    int defaultJobCount() {
+        int jobs = availableCpus();
+        auto memory_limit = cgroupMemoryLimit();
+        if (!memory_limit) return jobs;
+        uint64_t total_rss_kb = 0, count = 0;
+        for (const auto& [name, entry] : step_history) {
+            if (entry.peak_rss_kb == 0) continue;
+            total_rss_kb += entry.peak_rss_kb;
+            count++;
+        }
+        uint64_t avg_rss = count > 0 ? total_rss_kb / count * 1024 : 512ull * 1024 * 1024;
+        return std::clamp<int>(static_cast<int>(*memory_limit / std::max<uint64_t>(avg_rss, 1)), 1, jobs);
+    }
+
+    // everything configure() result depends on, besides build script itself
+    Hash graphKey() {
+        auto h = self_hash;
+        std::vector<std::pair<std::string, std::string>> opts;
+        for (const auto& [key, value] : parsed_options) opts.push_back({key, value.value_or("")});
+        std::sort(opts.begin(), opts.end());
+        for (const auto& [key, value] : opts) h = h.combine(hashString(key)).combine(hashString(value));
+        for (const auto& arg : cli_args) h = h.combine(hashString(arg));
+        h = h.combine(hashString(global_flags.compile_driver.string())).combine(hashCXXFlags({}));
+        auto no_overlay = LibOrExeCXXFlagsOverlay{};
+        h = h.combine(hashWholeObjOpts(&no_overlay));
+        h = h.combine(hashString(root.string())).combine(hashString(out.string()));
+        h = h.combine(hashString(static_link_tool.value_or("").string()));
+        return h;
+    }
+
+    // records outermost builtin call into graph_calls, nested ones are reproduced by replaying the outer one
+    struct GraphCallGuard {
+        Build* b;
+        CacheWriter* w; // null if call is nested
+
+        GraphCallGuard(Build* b, GraphCall call) : b(b), w(b->graph_call_depth++ == 0 ? &b->graph_calls : nullptr) {
+            if (w) w->u64(static_cast<uint64_t>(call));
+        }
+
+        ~GraphCallGuard() {
+            b->graph_call_depth--;
+        }
+    };
+
+    void replayGraphCall(CacheReader* r) {
+        switch (static_cast<GraphCall>(r->u64())) {
+            case GraphCall::Exe: {
+                ExeOpts opts;
+                std::vector<Path> sources;
+                snap(r, &opts);
+                snap(r, &sources);
+                if (r->ok) addExe(opts, sources);
+                break;
+            }
+            case GraphCall::Lib: {
+                LibraryOpts opts;
+                std::vector<Path> sources;
+                snap(r, &opts);
+                snap(r, &sources);
+                if (r->ok) addLib(opts, sources);
+                break;
+            }
+            case GraphCall::File: {
+                Path src;
+                snap(r, &src);
+                if (r->ok) addFile(src);
+                break;
+            }
+            case GraphCall::Obj: {
+                ObjOpts opts;
+                bool silent = false;
+                snap(r, &opts);
+                snap(r, &silent);
+                if (r->ok) addObj(opts, silent);
+                break;
+            }
+            case GraphCall::RunExe: {
+                uint64_t exe_id = 0;
+                RunOptions opts;
+                snap(r, &exe_id);
+                snap(r, &opts);
+                auto exe = exeByLinkStep(stepById(r, exe_id));
+                if (!exe) r->ok = false;
+                if (r->ok) addRunExe(exe, opts);
+                break;
+            }
+            case GraphCall::Install: {
+                uint64_t step_id = 0;
+                Path dst;
+                snap(r, &step_id);
+                snap(r, &dst);
+                auto step = stepById(r, step_id);
+                if (!step) r->ok = false;
+                if (r->ok) install(step, dst);
+                break;
+            }
+            case GraphCall::InstallHeaders: {
+                std::vector<Path> headers;
+                InstallHeaderOpts opts;
+                snap(r, &headers);
+                snap(r, &opts);
+                if (r->ok) installHeaders(headers, opts);
+                break;
+            }
+            case GraphCall::Fetch: {
+                std::string name;
+                Url url;
+                Hash expected_hash;
+                snap(r, &name);
+                snap(r, &url);
+                snap(r, &expected_hash);
+                if (r->ok) fetchByUrl(name, url, expected_hash);
+                break;
+            }
+            case GraphCall::Unpack: {
+                std::string name;
+                uint64_t tarball_id = 0;
+                snap(r, &name);
+                snap(r, &tarball_id);
+                auto tarball = stepById(r, tarball_id);
+                if (!tarball) r->ok = false;
+                if (r->ok) unpackTar(name, tarball);
+                break;
+            }
+            case GraphCall::CMake: {
+                uint64_t sources_id = 0;
+                std::string build_target;
+                std::vector<std::string> cmake_args;
+                snap(r, &sources_id);
+                snap(r, &build_target);
+                snap(r, &cmake_args);
+                auto sources = stepById(r, sources_id);
+                if (!sources) r->ok = false;
+                if (r->ok) runCMake(sources, build_target, cmake_args);
+                break;
+            }
+            case GraphCall::CMakeTarball: {
+                std::string name;
+                Url url;
+                Hash expected_hash;
+                std::vector<std::string> cmake_args;
+                snap(r, &name);
+                snap(r, &url);
+                snap(r, &expected_hash);
+                snap(r, &cmake_args);
+                if (r->ok) cmakeFromTarballUrl(name, url, expected_hash, cmake_args);
+                break;
+            }
+            case GraphCall::BatchCommand: {
+                BatchCommandOpts opts;
+                snap(r, &opts);
+                if (r->ok) addBatchCommand(opts);
+                break;
+            }
+            default: r->ok = false;
+        }
+    }
+
+    void saveGraphSnapshot() {
+        for (auto* step : step_order) {
+            if (step->dyndep) graph_snapshotable = false; // callback can't be restored
+        }
+        if (!graph_snapshotable) {
+            if (verbose) blog("Build graph is not saved: script adds its own steps or subprojects\n");
+            return;
+        }
+        CacheWriter w;
+        w.u64(graph_snapshot_version);
+        w.u64(graph_key.value);
+        w.u64(glob_results.size());
+        for (const auto& [pattern, h] : glob_results) {
+            w.str(pattern);
+            w.u64(h.value);
+        }
+        w.str(graph_calls.buf);
+        w.u64(step_order.size());
+        for (auto* step : step_order) {
+            std::vector<uint64_t> deps;
+            for (auto* dep : step->deps) deps.push_back(stepId(dep));
+            snap(&w, step->opts);
+            snap(&w, deps);
+            snap(&w, step->inputs);
+        }
+        w.u64(objs.size());
+        for (const auto& obj : objs) snap(&w, obj.opts);
+        w.u64(exes.size());
+        for (const auto& exe : exes) snap(&w, exe.opts);
+        w.u64(libs.size());
+        for (const auto& lib : libs) snap(&w, lib.opts);
+        snap(&w, dump_compile_commands);
+        snap(&w, source_hashing);
+        snap(&w, preprocessed_obj_keys);
+        snap(&w, global_flags);
+        snap(&w, global_lib_exe_flags);
+        snap(&w, static_link_tool);
+        w.u64(pools.size());
+        for (const auto& [name, pool] : pools) {
+            w.str(name);
+            w.u64(static_cast<uint64_t>(static_cast<int64_t>(pool.depth)));
+            snap(&w, pool.takes_job_slot);
+        }
+        if (!graph_snapshotable) return; // references steps of other build
+
+        auto tmp_path = newTmpPath();
+        writeEntireFile(tmp_path, w.buf);
+        std::error_code ec;
+        std::filesystem::rename(tmp_path, graphSnapshotPath(), ec);
+        if (ec) panic("Failed to save build graph to %s: %s\n", graphSnapshotPath().c_str(), ec.message().c_str());
+    }
+
+    // 0 is reserved for "no step"
+    uint64_t stepId(Step* step) {
+        auto it = step_ids.find(step);
+        if (it == step_ids.end()) {
+            graph_snapshotable = false;
+            return 0;
+        }
+        return it->second + 1;
+    }
+
+    Step* stepById(CacheReader* r, uint64_t id) {
+        if (id == 0) return nullptr;
+        if (id > step_order.size()) {
+            r->ok = false;
+            return nullptr;
+        }
+        return step_order[id - 1];
+    }
+
+    Exe* exeByLinkStep(Step* step) {
+        for (auto& exe : exes) {
+            if (exe.link_step == step) return &exe;
+        }
+        return nullptr;
+    }
+
+    // (de)serialization of configuration structures for graph snapshot, field by field
+    void snap(CacheWriter* w, uint64_t v) { w->u64(v); }
+    void snap(CacheWriter* w, const std::string& v) { w->str(v); }
+    void snap(CacheWriter* w, const Path& v) { w->str(v.string()); }
+    void snap(CacheWriter* w, Hash v) { w->u64(v.value); }
+    void snap(CacheWriter* w, const Url& v) { w->str(v.value); }
+
+    template <typename E, std::enable_if_t<std::is_enum_v<E>, int> = 0>
+    void snap(CacheWriter* w, E v) { w->u64(static_cast<uint64_t>(v)); }
+
+    template <typename T>
+    void snap(CacheWriter* w, const std::vector<T>& v) {
+        w->u64(v.size());
+        for (const auto& item : v) snap(w, item);
+    }
+
+    template <typename T>
+    void snap(CacheWriter* w, const std::optional<T>& v) {
+        w->u64(v.has_value());
+        if (v.has_value()) snap(w, *v);
+    }
+
+    void snap(CacheWriter* w, const LazyPath& v) {
+        w->u64(v.step ? stepId(v.step) : 0);
+        w->str(v.path.string());
+    }
+
+    void snap(CacheWriter* w, const Define& v) {
+        w->str(v.name);
+        w->str(v.value);
+    }
+
+    void snap(CacheWriter* w, const Step::Options& v) {
+        snap(w, v.name);
+        snap(w, v.desc);
+        snap(w, v.phony);
+        snap(w, v.silent);
+        snap(w, v.pool);
+        snap(w, v.outputs);
+    }
+
+    void snap(CacheWriter* w, const CXXFlagsOverlay& v) {
+        snap(w, v.compile_driver);
+        snap(w, v.include_paths);
+        snap(w, v.library_paths);
+        snap(w, v.libraries);
+        snap(w, v.libraries_system);
+        snap(w, v.defines);
+        snap(w, v.warnings);
+        snap(w, v.optimize);
+        snap(w, v.standard);
+        snap(w, v.extra_flags);
+    }
+
+    void snap(CacheWriter* w, const CXXFlags& v) {
+        snap(w, v.compile_driver);
+        snap(w, v.include_paths);
+        snap(w, v.library_paths);
+        snap(w, v.libraries);
+        snap(w, v.libraries_system);
+        snap(w, v.defines);
+        snap(w, v.warnings);
+        snap(w, v.optimize);
+        snap(w, v.standard);
+        snap(w, v.extra_flags);
+    }
+
+    void snap(CacheWriter* w, const LibOrExeCXXFlagsOverlay& v) {
+        snap(w, v.asan);
+        snap(w, v.debug_info);
+        snap(w, v.lto);
+    }
+
+    void snap(CacheWriter* w, const LibOrExeCXXFlags& v) {
+        snap(w, v.asan);
+        snap(w, v.debug_info);
+        snap(w, v.lto);
+    }
+
+    void snap(CacheWriter* w, const ObjOpts& v) {
+        snap(w, v.flags);
+        snap(w, v.source);
+        uint64_t owner = 0; // opt_whole points into exe that owns this obj
+        for (const auto& exe : exes) {
+            if (&exe.opts.exe_flags == v.opt_whole) owner = stepId(exe.link_step);
+        }
+        if (v.opt_whole && owner == 0) graph_snapshotable = false;
+        snap(w, owner);
+        snap(w, v.pch);
+        snap(w, v.generated_source);
+    }
+
+    void snap(CacheWriter* w, const PchOpts& v) {
+        snap(w, v.header);
+        snap(w, v.automatic);
+        snap(w, v.max_headers);
+    }
+
+    void snap(CacheWriter* w, const ExeOpts& v) {
+        snap(w, v.name);
+        snap(w, v.desc);
+        snap(w, v.obj);
+        snap(w, v.link);
+        snap(w, v.exe_flags);
+        snap(w, v.pch);
+        snap(w, v.generated_sources);
+    }
+
+    void snap(CacheWriter* w, const LibraryOpts& v) {
+        snap(w, v.name);
+        snap(w, v.desc);
+        snap(w, v.obj);
+        snap(w, v.static_lib);
+        snap(w, v.lib_flags);
+        snap(w, v.pch);
+        snap(w, v.generated_sources);
+    }
+
+    void snap(CacheWriter* w, const RunOptions& v) {
+        snap(w, v.name);
+        snap(w, v.desc);
+        snap(w, v.working_dir);
+        snap(w, v.ld_library_paths);
+        snap(w, v.args);
+    }
+
+    void snap(CacheWriter* w, const BatchCommandOpts& v) {
+        snap(w, v.name);
+        snap(w, v.desc);
+        snap(w, v.cmd);
+        snap(w, v.inputs);
+        snap(w, v.outputs);
+        snap(w, static_cast<uint64_t>(v.chunk_size));
+    }
+
+    void snap(CacheWriter* w, const InstallHeaderOpts& v) {
+        snap(w, v.prefix);
+        snap(w, v.as_tree);
+    }
+
+    void snap(CacheReader* r, uint64_t* v) { *v = r->u64(); }
+    void snap(CacheReader* r, bool* v) { *v = r->u64() != 0; }
+    void snap(CacheReader* r, std::string* v) { *v = r->str(); }
+    void snap(CacheReader* r, Path* v) { *v = r->str(); }
+    void snap(CacheReader* r, Hash* v) { v->value = r->u64(); }
+    void snap(CacheReader* r, Url* v) { v->value = r->str(); }
+
+    template <typename E, std::enable_if_t<std::is_enum_v<E>, int> = 0>
+    void snap(CacheReader* r, E* v) { *v = static_cast<E>(r->u64()); }
+
+    template <typename T>
+    void snap(CacheReader* r, std::vector<T>* v) {
+        auto size = r->u64();
+        v->clear();
+        for (uint64_t i = 0; i < size && r->ok; i++) {
+            T item{};
+            snap(r, &item);
+            v->push_back(item);
+        }
+    }
+
+    template <typename T>
+    void snap(CacheReader* r, std::optional<T>* v) {
+        *v = std::nullopt;
+        if (r->u64() == 0) return;
+        T item{};
+        snap(r, &item);
+        *v = item;
+    }
+
+    void snap(CacheReader* r, LazyPath* v) {
+        v->step = stepById(r, r->u64());
+        v->path = r->str();
+    }
+
+    void snap(CacheReader* r, Define* v) {
+        v->name = r->str();
+        v->value = r->str();
+    }
+
+    void snap(CacheReader* r, Step::Options* v) {
+        snap(r, &v->name);
+        snap(r, &v->desc);
+        snap(r, &v->phony);
+        snap(r, &v->silent);
+        snap(r, &v->pool);
+        snap(r, &v->outputs);
+    }
+
+    void snap(CacheReader* r, CXXFlagsOverlay* v) {
+        snap(r, &v->compile_driver);
+        snap(r, &v->include_paths);
+        snap(r, &v->library_paths);
+        snap(r, &v->libraries);
+        snap(r, &v->libraries_system);
+        snap(r, &v->defines);
+        snap(r, &v->warnings);
+        snap(r, &v->optimize);
+        snap(r, &v->standard);
+        snap(r, &v->extra_flags);
+    }
+
+    void snap(CacheReader* r, CXXFlags* v) {
+        snap(r, &v->compile_driver);
+        snap(r, &v->include_paths);
+        snap(r, &v->library_paths);
+        snap(r, &v->libraries);
+        snap(r, &v->libraries_system);
+        snap(r, &v->defines);
+        snap(r, &v->warnings);
+        snap(r, &v->optimize);
+        snap(r, &v->standard);
+        snap(r, &v->extra_flags);
+    }
+
+    void snap(CacheReader* r, LibOrExeCXXFlagsOverlay* v) {
+        snap(r, &v->asan);
+        snap(r, &v->debug_info);
+        snap(r, &v->lto);
+    }
+
+    void snap(CacheReader* r, LibOrExeCXXFlags* v) {
+        snap(r, &v->asan);
+        snap(r, &v->debug_info);
+        snap(r, &v->lto);
+    }
+
+    void snap(CacheReader* r, ObjOpts* v) {
+        snap(r, &v->flags);
+        snap(r, &v->source);
+        auto owner = exeByLinkStep(stepById(r, r->u64()));
+        v->opt_whole = owner ? &owner->opts.exe_flags : nullptr;
+        snap(r, &v->pch);
+        snap(r, &v->generated_source);
+    }
+
+    void snap(CacheReader* r, PchOpts* v) {
+        snap(r, &v->header);
+        snap(r, &v->automatic);
+        snap(r, &v->max_headers);
+    }
+
+    void snap(CacheReader* r, ExeOpts* v) {
+        snap(r, &v->name);
+        snap(r, &v->desc);
+        snap(r, &v->obj);
+        snap(r, &v->link);
+        snap(r, &v->exe_flags);
+        snap(r, &v->pch);
+        snap(r, &v->generated_sources);
+    }
+
+    void snap(CacheReader* r, LibraryOpts* v) {
+        snap(r, &v->name);
+        snap(r, &v->desc);
+        snap(r, &v->obj);
+        snap(r, &v->static_lib);
+        snap(r, &v->lib_flags);
+        snap(r, &v->pch);
+        snap(r, &v->generated_sources);
+    }
+
+    void snap(CacheReader* r, RunOptions* v) {
+        snap(r, &v->name);
+        snap(r, &v->desc);
+        snap(r, &v->working_dir);
+        snap(r, &v->ld_library_paths);
+        snap(r, &v->args);
+    }
+
+    void snap(CacheReader* r, BatchCommandOpts* v) {
+        snap(r, &v->name);
+        snap(r, &v->desc);
+        snap(r, &v->cmd);
+        snap(r, &v->inputs);
+        snap(r, &v->outputs);
+        uint64_t chunk_size = 0;
+        snap(r, &chunk_size);
+        v->chunk_size = chunk_size;
+    }
+
+    void snap(CacheReader* r, InstallHeaderOpts* v) {
+        snap(r, &v->prefix);
+        snap(r, &v->as_tree);
+    }
+
     // disablable with --silent
     int blog(const char* fmt, ...) {
         if (silent) return 0;
@@ -1770,16 +6331,24 @@ extern "C" void configure_stable(Build* b) { // NOLINT
     configure(b);
 }
 
+extern "C" void bpp_attach_runtime(Runtime* rt) { // NOLINT
+    bpp_runtime = rt;
+}
+
 int main(int argc, char** argv) { // NOLINT
     auto env_cache = std::getenv("BPP_CACHE_PREFIX");
     auto env_prefix = std::getenv("BPP_INSTALL_PREFIX");
+    if (auto code = Build::forwardToServer(argc, argv, Path{argv[0]}.parent_path(), env_cache)) return *code;
     Build b{argc, argv, Path{argv[0]}.parent_path().c_str(), env_cache, env_prefix, detectEnvFlags()};
-    b.recompileBuildScriptIfChanged();
+    b.checkBuildScript();
     b.preConfigure();
-    try {
-        configure(&b);
-    } catch (const std::exception& e) {
-        panic("your build script exited with exception: %s\n", e.what());
+    if (!b.loadGraphSnapshot()) {
+        auto configure_fn = b.loadBuildScript(configure_stable);
+        try {
+            configure_fn(&b);
+        } catch (const std::exception& e) {
+            panic("your build script exited with exception: %s\n", e.what());
+        }
     }
     b.postConfigure();
     try {
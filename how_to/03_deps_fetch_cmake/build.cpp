@@ -26,6 +26,7 @@ std::pair<Step*, Path> gtestInstall(Build* b, std::string version) {
 
 void configure(Build* b) {
     b->dump_compile_commands = true;
+    b->snapshot_graph = true; // next runs skip configure() until this script or options change
 
     b->global_flags.compile_driver = "clang++";
 
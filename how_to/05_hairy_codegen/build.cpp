@@ -58,6 +58,7 @@ void configure(Build* b) {
     auto installed_cg = b->install(codegen, codegened_path);
     // ensure codegen runs and copied to codegened_path before library is built
     foobar->dependLibOn(installed_cg);
+    main->dependExeOn(installed_cg); // main.cpp includes generated file too
 
     // Creates "Step" that will execute artefact of some target with arguments.
     b->addRunExe(main, { .name = "run", .desc = "Run the main executable", .args = b->cli_args});
@@ -12,6 +12,7 @@ std::pair<Step*, Path> fetchUnpackLuaSources(Build* b, std::string version, Hash
 void configure(Build* b) {
     auto [lua_src, lua_prefix] = fetchUnpackLuaSources(b, "5.4.6", Hash{8816149851772971551});
     b->dump_compile_commands = true;
+    b->snapshot_graph = true; // next runs skip configure() until this script or options change
 
     auto use_readline = b->option<bool>("use-readline", "Use GNU Readline library").value_or(false);
 
@@ -0,0 +1,42 @@
+#define BPP_RECOMPILE_SELF_CMD "clang++"
+#include "buildpp.h"
+
+// writes one source per line of config, and header that lists them all
+void genShapes(Path out_dir, Path config) {
+    std::filesystem::create_directories(out_dir);
+    std::ifstream fin{config};
+    std::string name, factor, decls, list;
+    while (fin >> name >> factor) {
+        writeEntireFile(out_dir / (name + ".cpp"), "double area_" + name + "() { return " + factor + "; }\n");
+        decls += "double area_" + name + "();\n";
+        list += "        {\"" + name + "\", area_" + name + "},\n";
+    }
+    writeEntireFile(out_dir / "shapes.h", "#pragma once\n#include <vector>\n" + decls
+        + "struct Shape { const char* name; double (*area)(); };\n"
+        + "inline std::vector<Shape> allShapes() {\n    return {\n" + list + "    };\n}\n");
+}
+
+void configure(Build* b) {
+    // generated sources are not known until codegen runs, so they are added to the graph by dyndep callback,
+    // and compiled in parallel with everything else that is ready
+    auto codegen = b->addStep({.name = "shapes-codegen", .desc = "Generates source per shape from config"});
+    codegen->inputs.push_back(b->addFile("configs/shapes.txt"));
+    codegen->inputs_hash = [](Hash h) { return h.combine(hashString("shapes-codegen-v1")); };
+    codegen->action = [=](Output out) { genShapes(out, b->completedInputs(codegen).at(0)); };
+
+    auto flags = CXXFlagsOverlay{.include_paths = {{.step = codegen}}, .standard = CXXStandard::CXX17};
+    auto main = b->addExe({.name = "main", .desc = "Prints areas of generated shapes", .obj = flags}, {"main.cpp"});
+    main->dependExeOn(codegen); // main.cpp includes generated header
+
+    codegen->dyndep = [=](Path generated) {
+        for (const auto& entry : std::filesystem::directory_iterator{generated}) {
+            if (entry.path().extension() != ".cpp") continue;
+            auto obj = b->addObj({.flags = flags, .source = entry.path()}, true);
+            obj->step->opts.name = "shapes/" + entry.path().stem().string() + ".o";
+            main->link_step->inputs.push_back({.step = obj->step});
+        }
+    };
+
+    b->installExe(main);
+    b->addRunExe(main, {.name = "run", .desc = "Run the main executable", .args = b->cli_args});
+}
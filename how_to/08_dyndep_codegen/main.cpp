@@ -0,0 +1,9 @@
+#include <cstdio>
+#include "shapes.h"
+
+int main() {
+    for (const auto& shape : allShapes()) {
+        std::printf("%s: area of unit shape is %f\n", shape.name, shape.area());
+    }
+    return 0;
+}